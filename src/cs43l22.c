@@ -45,9 +45,16 @@
 /** @defgroup CS43L22_Private_Defines
   * @{
   */
-#define I2Cx_TIMEOUT_MAX 0x1000
 #define CODEC_STANDARD 0x04
 
+/* Number of SCL pulses needed to free a slave holding SDA low */
+#define CODEC_BUS_RECOVERY_CLOCKS 9
+/* Busy loop count for half an SCL period during the bus recovery (~100 kHz) */
+#define CODEC_BUS_RECOVERY_DELAY  0x40
+
+/* Speaker mono mode (SPKSWAP and SPKMONO bits of CS43L22_REG_PLAYBACK_CTL2) */
+#define CODEC_SPEAKER_MONO 0x06
+
 #define VOLUME_CONVERT(Volume)    (((Volume) > 100)? 255:((uint8_t)(((Volume) * 255) / 100)))  
 /* Uncomment this line to enable verifying data sent to codec after each write 
    operation (for debug purpose) */
@@ -61,6 +68,39 @@
 /** @defgroup CS43L22_Private_Macros
   * @{
   */
+#define CODEC_I2C_TIMEOUT(h)  (((h)->i2cTimeout != 0)? (h)->i2cTimeout : CS43L22_I2C_TIMEOUT)
+#define CODEC_I2C_RETRIES(h)  (((h)->i2cRetries != 0)? (h)->i2cRetries : CS43L22_I2C_RETRIES)
+#define CODEC_I2C_BACKOFF(h)  (((h)->i2cBackoff != 0)? (h)->i2cBackoff : CS43L22_I2C_BACKOFF)
+
+/* The software downmix needs the blocks to go through TxRefillCallback */
+#define CODEC_HAS_REFILL(h)   ((h)->TxRefillCallback != NULL)
+
+#if CS43L22_USE_OS
+/* Hands the call over to the audio task when made from another thread */
+#define CODEC_DISPATCH(h, Cmd, Arg0, Arg1, Arg2, Ptr)                                        \
+  do {                                                                                      \
+    if (cs43l22_IsRemote(h))                                                                \
+      return (HAL_StatusTypeDef)cs43l22_Dispatch((h), (Cmd), (Arg0), (Arg1), (Arg2), (Ptr)); \
+  } while (0)
+
+/* Routing state handed over between the control and the refill tasks */
+#define CODEC_ROUTE_LOCK(h, Key)                                                            \
+  do {                                                                                      \
+    (Key) = 0;                                                                              \
+    if ((h)->routeMutex != NULL) cs43l22_OS_MutexLock((h)->routeMutex, CS43L22_OS_WAIT_FOREVER); \
+  } while (0)
+#define CODEC_ROUTE_UNLOCK(h, Key)                                                          \
+  do {                                                                                      \
+    (void)(Key);                                                                            \
+    if ((h)->routeMutex != NULL) cs43l22_OS_MutexUnlock((h)->routeMutex);                   \
+  } while (0)
+#else
+#define CODEC_DISPATCH(h, Cmd, Arg0, Arg1, Arg2, Ptr)
+
+/* The block boundary may run in the DMA interrupt */
+#define CODEC_ROUTE_LOCK(h, Key)    do { (Key) = __get_PRIMASK(); __disable_irq(); } while (0)
+#define CODEC_ROUTE_UNLOCK(h, Key)  __set_PRIMASK(Key)
+#endif /* CS43L22_USE_OS */
 
 /**
   * @}
@@ -72,6 +112,26 @@
 
 /* Audio codec driver structure initialization */  
 
+/* CS43L22_REG_CH_MIXER_SWAP value of each CS43L22_CHMAP_xxx */
+static const uint8_t CODEC_ChannelMixer[] = {
+  0x00, /* STEREO: A = L,       B = R */
+  0xF0, /* SWAP:   A = R,       B = L */
+  0x50, /* MONO:   A = (L+R)/2, B = (L+R)/2 */
+  0x30, /* LEFT:   A = L,       B = L */
+  0xC0, /* RIGHT:  A = R,       B = R */
+};
+
+/* Software channel map giving CS43L22_CHMAP_xxx (column) through the codec
+   mixer set to CS43L22_CHMAP_xxx (row). Mixers that lose a channel give
+   STEREO for the maps they cannot produce. */
+static const uint8_t CODEC_SwChannelMap[5][5] = {
+  /* STEREO */ { CS43L22_CHMAP_STEREO, CS43L22_CHMAP_SWAP,   CS43L22_CHMAP_MONO,   CS43L22_CHMAP_LEFT,   CS43L22_CHMAP_RIGHT  },
+  /* SWAP   */ { CS43L22_CHMAP_SWAP,   CS43L22_CHMAP_STEREO, CS43L22_CHMAP_MONO,   CS43L22_CHMAP_LEFT,   CS43L22_CHMAP_RIGHT  },
+  /* MONO   */ { CS43L22_CHMAP_STEREO, CS43L22_CHMAP_STEREO, CS43L22_CHMAP_STEREO, CS43L22_CHMAP_LEFT,   CS43L22_CHMAP_RIGHT  },
+  /* LEFT   */ { CS43L22_CHMAP_STEREO, CS43L22_CHMAP_STEREO, CS43L22_CHMAP_MONO,   CS43L22_CHMAP_STEREO, CS43L22_CHMAP_RIGHT  },
+  /* RIGHT  */ { CS43L22_CHMAP_STEREO, CS43L22_CHMAP_STEREO, CS43L22_CHMAP_MONO,   CS43L22_CHMAP_LEFT,   CS43L22_CHMAP_STEREO },
+};
+
 /**
   * @}
   */ 
@@ -80,6 +140,21 @@
   * @{
   */
 static HAL_StatusTypeDef CODEC_IO_Write(cs43l22_HandlerTypeDef *hcs43, uint8_t Reg, uint8_t Value);
+static HAL_StatusTypeDef CODEC_IO_Read(cs43l22_HandlerTypeDef *hcs43, uint8_t Reg, uint8_t *Value);
+static HAL_StatusTypeDef CODEC_IO_Transfer(cs43l22_HandlerTypeDef *hcs43, uint8_t Reg, uint8_t Value);
+static HAL_StatusTypeDef CODEC_IO_ReadReg(cs43l22_HandlerTypeDef *hcs43, uint8_t Reg, uint8_t *Value);
+static HAL_StatusTypeDef CODEC_Resync(cs43l22_HandlerTypeDef *hcs43);
+static HAL_StatusTypeDef CODEC_IO_Faulted(cs43l22_HandlerTypeDef *hcs43);
+static void              CODEC_IO_Backoff(cs43l22_HandlerTypeDef *hcs43, uint8_t Attempt);
+static void              CODEC_BusDelay(void);
+static void              CODEC_CacheStore(cs43l22_HandlerTypeDef *hcs43, uint8_t Reg, uint8_t Value);
+static uint8_t           CODEC_OutputPower(uint16_t OutputDevice);
+static uint8_t           CODEC_RouteEngine(cs43l22_HandlerTypeDef *hcs43, const cs43l22_RoutingTypeDef *Routing);
+static void              CODEC_SelectRouting(cs43l22_HandlerTypeDef *hcs43);
+static uint8_t           CODEC_SoftwareMap(cs43l22_HandlerTypeDef *hcs43);
+static uint8_t           CODEC_MixerChannelMap(uint8_t Mixer);
+static HAL_StatusTypeDef CODEC_WriteRouting(cs43l22_HandlerTypeDef *hcs43, const cs43l22_RoutingTypeDef *Routing, uint8_t Engine);
+static void              CODEC_Downmix(uint16_t *pBuffer, uint16_t Size, uint8_t ChannelMap);
 /**
   * @}
   */ 
@@ -100,30 +175,29 @@ HAL_StatusTypeDef cs43l22_Init(cs43l22_HandlerTypeDef *hcs43, uint16_t OutputDev
 {
   uint8_t err = 0;
   HAL_StatusTypeDef status;
+
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_INIT, OutputDevice, Volume, AudioFreq, NULL);
   
+  /* Forget the register image and the bus state of any previous session */
+  hcs43->regValid = 0;
+  hcs43->ioRecovering = 0;
+  hcs43->ioFault = 0;
+  hcs43->ioFaultTick = 0;
+
   /*Save Output device for mute ON/OFF procedure*/
-  switch (OutputDevice)
-  {
-  case OUTPUT_DEVICE_SPEAKER:
-    hcs43->outputDevice = 0xFA;
-    break;
-    
-  case OUTPUT_DEVICE_HEADPHONE:
-    hcs43->outputDevice = 0xAF;
-    break;
-    
-  case OUTPUT_DEVICE_BOTH:
-    hcs43->outputDevice = 0xAA;
-    break;
-    
-  case OUTPUT_DEVICE_AUTO:
-    hcs43->outputDevice = 0x05;
-    break;    
-    
-  default:
-    hcs43->outputDevice = 0x05;
-    break;    
-  }
+  hcs43->outputDevice = CODEC_OutputPower(OutputDevice);
+
+  /* Default routing: stereo, speaker in mono mode when it is enabled */
+  hcs43->routing.outputDevice = (uint8_t)OutputDevice;
+  hcs43->routing.channelMap = CS43L22_CHMAP_STEREO;
+  hcs43->routing.speakerMono = (OutputDevice != OUTPUT_DEVICE_HEADPHONE)? 1 : 0;
+  hcs43->routing.engine = CS43L22_ROUTE_AUTO;
+  hcs43->routeUpdate = 0;
+  hcs43->routeHwUpdate = 0;
+  hcs43->routeHwReady = 0;
+  hcs43->routeEngine = CS43L22_ROUTE_HW;
+  hcs43->swChannelMap = CS43L22_CHMAP_STEREO;
+  hcs43->hwChannelMap = CS43L22_CHMAP_STEREO;
   
   /* Initialize the Control interface of the Audio Codec */
   if ((status = AUDIO_IO_Init(hcs43)) != HAL_OK) return status;
@@ -142,12 +216,12 @@ HAL_StatusTypeDef cs43l22_Init(cs43l22_HandlerTypeDef *hcs43, uint16_t OutputDev
   /* Set the Master volume */
   err += cs43l22_SetVolume(hcs43, Volume);
   
-  /* If the Speaker is enabled, set the Mono mode and volume attenuation level */
-  if(OutputDevice != OUTPUT_DEVICE_HEADPHONE)
+  /* Default routing: stereo channel mixer, Speaker Mono mode if enabled */
+  err += CODEC_WriteRouting(hcs43, &hcs43->routing, hcs43->routeEngine);
+
+  /* If the Speaker is enabled, set the volume attenuation level */
+  if(hcs43->routing.speakerMono)
   {
-    /* Set the Speaker Mono mode */  
-    err += CODEC_IO_Write(hcs43, CS43L22_REG_PLAYBACK_CTL2, 0x06);
-    
     /* Set the Speaker attenuation level */  
     err += CODEC_IO_Write(hcs43, CS43L22_REG_SPEAKER_A_VOL, 0x00);
     err += CODEC_IO_Write(hcs43, CS43L22_REG_SPEAKER_B_VOL, 0x00);
@@ -183,6 +257,8 @@ HAL_StatusTypeDef cs43l22_Init(cs43l22_HandlerTypeDef *hcs43, uint16_t OutputDev
   */
 HAL_StatusTypeDef cs43l22_DeInit(cs43l22_HandlerTypeDef *hcs43)
 {
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_DEINIT, 0, 0, 0, NULL);
+
   /* Deinitialize Audio Codec interface */
   return AUDIO_IO_DeInit(hcs43);
 }
@@ -194,20 +270,44 @@ HAL_StatusTypeDef cs43l22_DeInit(cs43l22_HandlerTypeDef *hcs43)
   */
 uint8_t cs43l22_ReadID(cs43l22_HandlerTypeDef *hcs43)
 {
-  uint8_t Value;
+  uint8_t Value = 0;
+
+#if CS43L22_USE_OS
+  if (cs43l22_IsRemote(hcs43)) return (uint8_t)cs43l22_Dispatch(hcs43, CS43L22_CMD_READ_ID, 0, 0, 0, NULL);
+#endif /* CS43L22_USE_OS */
+
   /* Initialize the Control interface of the Audio Codec */
   AUDIO_IO_Init(hcs43); 
   
-  Value = AUDIO_IO_Read(hcs43, CS43L22_CHIPID_ADDR);
+  if (CODEC_IO_Read(hcs43, CS43L22_CHIPID_ADDR, &Value) != HAL_OK) return 0;
   Value = (Value & CS43L22_ID_MASK);
   
   return((uint32_t) Value);
 }
 
+/**
+  * @brief Starts the DMA transfer of the audio buffer to the codec.
+  * @param pBuffer: Audio samples.
+  * @param Size: Number of samples in pBuffer.
+  * @retval 0 if correct communication, else wrong communication
+  */
 HAL_StatusTypeDef cs43l22_StreamSound(cs43l22_HandlerTypeDef *hcs43, uint16_t* pBuffer, uint16_t Size)
 {
   uint8_t counter = 0;
+
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_STREAM_SOUND, Size, 0, 0, pBuffer);
+
+  hcs43->txBuffer = pBuffer;
+  hcs43->txSize = Size;
+
+  /* The buffer is sent once before the first refill */
+  if (hcs43->swChannelMap != CS43L22_CHMAP_STEREO)
+  {
+    CODEC_Downmix(pBuffer, Size, hcs43->swChannelMap);
+  }
+
   counter += HAL_I2S_Transmit_DMA(hcs43->hi2s, pBuffer, Size);
+
   return (counter == 0)? HAL_OK : HAL_ERROR;
 }
 
@@ -221,6 +321,8 @@ HAL_StatusTypeDef cs43l22_Play(cs43l22_HandlerTypeDef *hcs43)
 {
   uint8_t err = 0;
 
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_PLAY, 0, 0, 0, NULL);
+
   if(!(hcs43->isPlaying))
   {
     /* Enable the digital soft ramp */
@@ -246,6 +348,8 @@ HAL_StatusTypeDef cs43l22_Play(cs43l22_HandlerTypeDef *hcs43)
 HAL_StatusTypeDef cs43l22_Pause(cs43l22_HandlerTypeDef *hcs43)
 {  
   uint8_t err = 0;
+
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_PAUSE, 0, 0, 0, NULL);
  
   /* Pause the audio file playing */
   /* Mute the output first */
@@ -268,6 +372,9 @@ HAL_StatusTypeDef cs43l22_Resume(cs43l22_HandlerTypeDef *hcs43)
 {
   uint8_t err = 0;
   volatile uint32_t index = 0x00;
+
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_RESUME, 0, 0, 0, NULL);
+
   /* Resumes the audio file playing */  
   /* Unmute the output first */
   err += cs43l22_SetMute(hcs43, AUDIO_MUTE_OFF);
@@ -297,6 +404,8 @@ HAL_StatusTypeDef cs43l22_Resume(cs43l22_HandlerTypeDef *hcs43)
 HAL_StatusTypeDef cs43l22_Stop(cs43l22_HandlerTypeDef *hcs43, uint32_t CodecPdwnMode)
 {
   uint8_t err = 0;
+
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_STOP, CodecPdwnMode, 0, 0, NULL);
   
   err += HAL_I2S_DMAStop(hcs43->hi2s);
 
@@ -326,6 +435,8 @@ HAL_StatusTypeDef cs43l22_SetVolume(cs43l22_HandlerTypeDef *hcs43, uint8_t Volum
   uint8_t err = 0;
   uint8_t convertedvol = VOLUME_CONVERT(Volume);
 
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_SET_VOLUME, Volume, 0, 0, NULL);
+
   if(convertedvol > 0xE6)
   {
     /* Set the Master volume */
@@ -350,6 +461,8 @@ HAL_StatusTypeDef cs43l22_SetVolume(cs43l22_HandlerTypeDef *hcs43, uint8_t Volum
   */
 HAL_StatusTypeDef cs43l22_SetFrequency(cs43l22_HandlerTypeDef *hcs43, uint32_t AudioFreq)
 {
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_SET_FREQUENCY, AudioFreq, 0, 0, NULL);
+
   if (hcs43->isPlaying) cs43l22_Stop(hcs43, CODEC_PDWN_HW);
 
   hcs43->audioFrequency = AudioFreq;
@@ -367,6 +480,8 @@ HAL_StatusTypeDef cs43l22_SetFrequency(cs43l22_HandlerTypeDef *hcs43, uint32_t A
 HAL_StatusTypeDef cs43l22_SetMute(cs43l22_HandlerTypeDef *hcs43, uint8_t Cmd)
 {
   uint8_t err = 0;
+
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_SET_MUTE, Cmd, 0, 0, NULL);
   
   /* Set the Mute mode */
   if(Cmd == AUDIO_MUTE_ON)
@@ -396,6 +511,8 @@ HAL_StatusTypeDef cs43l22_SetMute(cs43l22_HandlerTypeDef *hcs43, uint8_t Cmd)
 HAL_StatusTypeDef cs43l22_SetOutputMode(cs43l22_HandlerTypeDef *hcs43, uint8_t Output)
 {
   uint8_t err = 0;
+
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_SET_OUTPUT_MODE, Output, 0, 0, NULL);
   
   switch (Output) 
   {
@@ -424,6 +541,7 @@ HAL_StatusTypeDef cs43l22_SetOutputMode(cs43l22_HandlerTypeDef *hcs43, uint8_t O
       hcs43->outputDevice = 0x05;
       break;
   }  
+  hcs43->routing.outputDevice = Output;
   return (err == 0)? HAL_OK : HAL_ERROR;
 }
 
@@ -434,11 +552,228 @@ HAL_StatusTypeDef cs43l22_SetOutputMode(cs43l22_HandlerTypeDef *hcs43, uint8_t O
   */
 HAL_StatusTypeDef cs43l22_Reset(cs43l22_HandlerTypeDef *hcs43)
 {
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_RESET, 0, 0, 0, NULL);
+
   AUDIO_IO_DeInit(hcs43);
   AUDIO_IO_Init(hcs43);
   return HAL_OK;
 }
 
+/**
+  * @brief Recovers the control bus and restores the codec configuration.
+  * @note  Called automatically when a register access still fails after the
+  *        retries (see CS43L22_I2C_AUTO_RECOVERY). The time spent is recorded
+  *        in hcs43->ioStats.
+  * @param hcs43: Codec handler.
+  * @retval HAL_OK if the codec answers again and was re-synchronized.
+  */
+HAL_StatusTypeDef cs43l22_Recover(cs43l22_HandlerTypeDef *hcs43)
+{
+  HAL_StatusTypeDef status;
+  uint32_t tickstart = HAL_GetTick();
+  uint32_t elapsed;
+
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_RECOVER, 0, 0, 0, NULL);
+
+  hcs43->ioRecovering = 1;
+  hcs43->ioStats.recoveries++;
+
+  status = AUDIO_IO_BusRecover(hcs43);
+  if (status == HAL_OK) status = CODEC_Resync(hcs43);
+
+  hcs43->ioRecovering = 0;
+  hcs43->ioFault = (status != HAL_OK)? 1 : 0;
+  hcs43->ioFaultTick = HAL_GetTick();
+
+  elapsed = HAL_GetTick() - tickstart;
+  hcs43->ioStats.lastRecoveryTime = elapsed;
+  if (elapsed > hcs43->ioStats.maxRecoveryTime) hcs43->ioStats.maxRecoveryTime = elapsed;
+  if (status != HAL_OK) hcs43->ioStats.failures++;
+
+  return status;
+}
+
+/**
+  * @brief Changes the output routing without stopping the stream.
+  * @note  While playing, the change is taken at the next block boundary
+  *        (cs43l22_RouteBlock()): the software downmix applies to the block
+  *        being refilled and the codec mixer is switched when that block
+  *        starts playing, by cs43l22_Process(). When stopped, the routing
+  *        is applied at once.
+  * @param Routing: Output device, channel map, speaker mono mode and engine.
+  *        CS43L22_ROUTE_AUTO uses the codec mixer, and the software downmix
+  *        while the control bus cannot be recovered, composed with the
+  *        mixer left on the codec. The software downmix needs
+  *        hcs43->TxRefillCallback: without it CS43L22_ROUTE_SW is rejected
+  *        and CS43L22_ROUTE_AUTO keeps the codec mixer.
+  * @retval 0 if correct communication, else wrong communication
+  */
+HAL_StatusTypeDef cs43l22_SetRouting(cs43l22_HandlerTypeDef *hcs43, const cs43l22_RoutingTypeDef *Routing)
+{
+  uint32_t key;
+  uint8_t engine;
+
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_SET_ROUTING, 0, 0, 0, (void *)Routing);
+
+  if ((Routing->channelMap > CS43L22_CHMAP_RIGHT) || (Routing->engine > CS43L22_ROUTE_SW)) return HAL_ERROR;
+  if ((Routing->engine == CS43L22_ROUTE_SW) && !CODEC_HAS_REFILL(hcs43)) return HAL_ERROR;
+
+  CODEC_ROUTE_LOCK(hcs43, key);
+  hcs43->routingPending = *Routing;
+  hcs43->routeUpdate = 1;
+
+  if (hcs43->isPlaying)
+  {
+    CODEC_ROUTE_UNLOCK(hcs43, key);
+    return HAL_OK;
+  }
+
+  /* No stream: no boundary to wait for */
+  CODEC_SelectRouting(hcs43);
+  hcs43->routeHwUpdate = 0;
+  hcs43->routeHwReady = 0;
+  engine = hcs43->routeEngine;
+  CODEC_ROUTE_UNLOCK(hcs43, key);
+
+  return CODEC_WriteRouting(hcs43, Routing, engine);
+}
+
+/**
+  * @brief Block boundary of the routing engine, to be called each time a
+  *        half of the DMA buffer has been released, after it was refilled.
+  *        cs43l22_TxBlock() does it.
+  * @note  Never accesses the codec, so it may be called from the DMA
+  *        callbacks: a codec mixer update is latched here and written by
+  *        cs43l22_Process() from thread context.
+  * @param pBuffer: Block just refilled (interleaved L, R), processed by the
+  *        software downmix. NULL if the block was not refilled.
+  * @param Size: Number of samples in pBuffer.
+  * @retval HAL_OK
+  */
+HAL_StatusTypeDef cs43l22_RouteBlock(cs43l22_HandlerTypeDef *hcs43, uint16_t *pBuffer, uint16_t Size)
+{
+  uint32_t key;
+  uint8_t channelMap;
+
+  CODEC_ROUTE_LOCK(hcs43, key);
+
+  /* The block prepared at the previous boundary starts playing now */
+  if (hcs43->routeHwUpdate)
+  {
+    hcs43->routeHwUpdate = 0;
+    hcs43->routeHw = hcs43->routing;
+    hcs43->routeHwEngine = hcs43->routeEngine;
+    hcs43->routeHwReady = 1;
+  }
+
+  /* Automatic routing follows the state of the control bus */
+  if (!(hcs43->routeUpdate) && (hcs43->routing.engine == CS43L22_ROUTE_AUTO) &&
+      (CODEC_RouteEngine(hcs43, &hcs43->routing) != hcs43->routeEngine))
+  {
+    hcs43->routingPending = hcs43->routing;
+    hcs43->routeUpdate = 1;
+  }
+
+  if (hcs43->routeUpdate)
+  {
+    CODEC_SelectRouting(hcs43);
+    hcs43->routeHwUpdate = 1;
+  }
+  else if (hcs43->routeEngine == CS43L22_ROUTE_SW)
+  {
+    /* Follow the codec mixer as the bus comes and goes */
+    hcs43->swChannelMap = CODEC_SoftwareMap(hcs43);
+  }
+
+  channelMap = hcs43->swChannelMap;
+  CODEC_ROUTE_UNLOCK(hcs43, key);
+
+  if ((pBuffer != NULL) && (channelMap != CS43L22_CHMAP_STEREO))
+  {
+    CODEC_Downmix(pBuffer, Size, channelMap);
+  }
+
+  return HAL_OK;
+}
+
+/**
+  * @brief Writes the codec mixer update latched at a block boundary.
+  * @note  Without CS43L22_USE_OS, call it from the main loop while playing.
+  *        With the audio task, the refill task hands each latched update
+  *        over to the control task, which calls it.
+  * @retval 0 if correct communication or nothing pending, else wrong
+  *         communication
+  */
+HAL_StatusTypeDef cs43l22_Process(cs43l22_HandlerTypeDef *hcs43)
+{
+  cs43l22_RoutingTypeDef routing;
+  uint32_t key;
+  uint8_t engine;
+  uint8_t ready;
+
+  CODEC_DISPATCH(hcs43, CS43L22_CMD_PROCESS, 0, 0, 0, NULL);
+
+  CODEC_ROUTE_LOCK(hcs43, key);
+  ready = hcs43->routeHwReady;
+  routing = hcs43->routeHw;
+  engine = hcs43->routeHwEngine;
+  hcs43->routeHwReady = 0;
+  CODEC_ROUTE_UNLOCK(hcs43, key);
+
+  if (!ready) return HAL_OK;
+
+  return CODEC_WriteRouting(hcs43, &routing, engine);
+}
+
+/**
+  * @brief Processes a half of the DMA buffer just released: refill through
+  *        TxRefillCallback, routing block boundary and analysis tap.
+  * @note  Called by the refill task when CS43L22_USE_OS is set, else by
+  *        cs43l22_TxHalfCpltISR()/cs43l22_TxCpltISR().
+  * @param pBlock: Released half of the buffer handed to cs43l22_StreamSound().
+  * @param Size: Number of samples in pBlock.
+  */
+void cs43l22_TxBlock(cs43l22_HandlerTypeDef *hcs43, uint16_t *pBlock, uint16_t Size)
+{
+  /* Nothing refilled: the buffer replays as it is, only the codec mixer
+     follows the routing */
+  if (hcs43->TxRefillCallback == NULL)
+  {
+    cs43l22_RouteBlock(hcs43, NULL, 0);
+  }
+  else
+  {
+    hcs43->TxRefillCallback(hcs43, pBlock, Size);
+    cs43l22_RouteBlock(hcs43, pBlock, Size);
+  }
+
+#if CS43L22_USE_ANALYSIS
+  if (hcs43->analysis != NULL) cs43l22_Analysis_Process(hcs43->analysis, pBlock, Size);
+#endif /* CS43L22_USE_ANALYSIS */
+}
+
+#if !CS43L22_USE_OS
+/**
+  * @brief To be called from HAL_I2S_TxHalfCpltCallback().
+  * @note  Runs cs43l22_TxBlock() in interrupt context. The codec is not
+  *        accessed: the application calls cs43l22_Process() from its main
+  *        loop to write a latched codec mixer update.
+  */
+void cs43l22_TxHalfCpltISR(cs43l22_HandlerTypeDef *hcs43)
+{
+  if (hcs43->txBuffer == NULL) return;
+  cs43l22_TxBlock(hcs43, hcs43->txBuffer, hcs43->txSize / 2);
+}
+
+/**
+  * @brief To be called from HAL_I2S_TxCpltCallback().
+  */
+void cs43l22_TxCpltISR(cs43l22_HandlerTypeDef *hcs43)
+{
+  if (hcs43->txBuffer == NULL) return;
+  cs43l22_TxBlock(hcs43, hcs43->txBuffer + (hcs43->txSize / 2), hcs43->txSize / 2);
+}
+#endif /* !CS43L22_USE_OS */
 
 __weak HAL_StatusTypeDef AUDIO_IO_Init(cs43l22_HandlerTypeDef *hcs43)
 {
@@ -454,51 +789,430 @@ __weak HAL_StatusTypeDef AUDIO_IO_DeInit(cs43l22_HandlerTypeDef *hcs43)
 
 __weak HAL_StatusTypeDef AUDIO_IO_Check(cs43l22_HandlerTypeDef *hcs43)
 {
-  return HAL_I2C_IsDeviceReady(hcs43->hi2c, hcs43->deviceAddr, 10, 1000);
+  return HAL_I2C_IsDeviceReady(hcs43->hi2c, hcs43->deviceAddr, 10, CODEC_I2C_TIMEOUT(hcs43));
 }
 
 
 __weak HAL_StatusTypeDef AUDIO_IO_Write(cs43l22_HandlerTypeDef *hcs43, uint8_t Reg, uint8_t Value)
 {
-  return HAL_I2C_Mem_Write(hcs43->hi2c, hcs43->deviceAddr, (uint16_t)Reg, I2C_MEMADD_SIZE_8BIT, &Value, 1, I2Cx_TIMEOUT_MAX);
+  return HAL_I2C_Mem_Write(hcs43->hi2c, hcs43->deviceAddr, (uint16_t)Reg, I2C_MEMADD_SIZE_8BIT, &Value, 1, CODEC_I2C_TIMEOUT(hcs43));
 }
 
 
+/**
+  * @brief  Reads a codec register.
+  * @note   The driver takes the transfer status from hcs43->ioReadStatus. A
+  *         board implementation that does not set it is seen as always
+  *         successful: read failures are then only caught by the write
+  *         verification.
+  */
 __weak uint8_t AUDIO_IO_Read(cs43l22_HandlerTypeDef *hcs43, uint8_t Reg)
 {
   uint8_t value = 0;
 
-  HAL_I2C_Mem_Read(hcs43->hi2c, hcs43->deviceAddr, (uint16_t)Reg, I2C_MEMADD_SIZE_8BIT, &value, 1, I2Cx_TIMEOUT_MAX);
+  hcs43->ioReadStatus = HAL_I2C_Mem_Read(hcs43->hi2c, hcs43->deviceAddr, (uint16_t)Reg, I2C_MEMADD_SIZE_8BIT, &value, 1, CODEC_I2C_TIMEOUT(hcs43));
   return value;
 }
 
 
+/**
+  * @brief  Frees a stuck bus: the I2C peripheral is released, SCL is clocked
+  *         until the slave lets SDA go, a STOP is generated and the
+  *         peripheral is initialized again.
+  * @note   Without sclPort/sdaPort in the handler only the peripheral is
+  *         re-initialized.
+  */
+__weak HAL_StatusTypeDef AUDIO_IO_BusRecover(cs43l22_HandlerTypeDef *hcs43)
+{
+  GPIO_InitTypeDef gpio = {0};
+  GPIO_PinState sda = GPIO_PIN_SET;
+  uint8_t clocks;
+
+  HAL_I2C_DeInit(hcs43->hi2c);
+
+  if ((hcs43->sclPort != NULL) && (hcs43->sdaPort != NULL))
+  {
+    /* Drive both lines as open-drain GPIOs, released high */
+    HAL_GPIO_WritePin(hcs43->sclPort, hcs43->sclPin, GPIO_PIN_SET);
+    HAL_GPIO_WritePin(hcs43->sdaPort, hcs43->sdaPin, GPIO_PIN_SET);
+    gpio.Mode = GPIO_MODE_OUTPUT_OD;
+    gpio.Pull = GPIO_NOPULL;
+    gpio.Speed = GPIO_SPEED_FREQ_LOW;
+    gpio.Pin = hcs43->sclPin;
+    HAL_GPIO_Init(hcs43->sclPort, &gpio);
+    gpio.Pin = hcs43->sdaPin;
+    HAL_GPIO_Init(hcs43->sdaPort, &gpio);
+    CODEC_BusDelay();
+
+    /* Clock out the byte the slave is still sending */
+    for (clocks = 0; clocks < CODEC_BUS_RECOVERY_CLOCKS; clocks++)
+    {
+      if (HAL_GPIO_ReadPin(hcs43->sdaPort, hcs43->sdaPin) == GPIO_PIN_SET) break;
+      HAL_GPIO_WritePin(hcs43->sclPort, hcs43->sclPin, GPIO_PIN_RESET);
+      CODEC_BusDelay();
+      HAL_GPIO_WritePin(hcs43->sclPort, hcs43->sclPin, GPIO_PIN_SET);
+      CODEC_BusDelay();
+    }
+
+    /* STOP condition: SDA rises while SCL is high */
+    HAL_GPIO_WritePin(hcs43->sclPort, hcs43->sclPin, GPIO_PIN_RESET);
+    CODEC_BusDelay();
+    HAL_GPIO_WritePin(hcs43->sdaPort, hcs43->sdaPin, GPIO_PIN_RESET);
+    CODEC_BusDelay();
+    HAL_GPIO_WritePin(hcs43->sclPort, hcs43->sclPin, GPIO_PIN_SET);
+    CODEC_BusDelay();
+    HAL_GPIO_WritePin(hcs43->sdaPort, hcs43->sdaPin, GPIO_PIN_SET);
+    CODEC_BusDelay();
+
+    sda = HAL_GPIO_ReadPin(hcs43->sdaPort, hcs43->sdaPin);
+  }
+
+  /* The MSP init gives the pins back to the I2C peripheral, even when SDA
+     is still held low */
+  if (HAL_I2C_Init(hcs43->hi2c) != HAL_OK) return HAL_ERROR;
+
+  return (sda == GPIO_PIN_SET)? HAL_OK : HAL_ERROR;
+}
+
+
 __weak HAL_StatusTypeDef AUDIO_IO_SetFrequency(cs43l22_HandlerTypeDef *hcs43, uint32_t AudioFreq)
 {
   return HAL_OK;
 }
 
 /**
-  * @brief  Writes/Read a single data.
+  * @brief  Writes a single data.
+  * @note   The value is kept in the register image used by the re-sync. When
+  *         the transfer still fails after the retries the bus is recovered
+  *         and the whole image is written back. While the codec is known to
+  *         be unreachable only the image is updated.
   * @param  Addr: I2C address
   * @param  Reg: Reg address 
   * @param  Value: Data to be written
-  * @retval None
+  * @retval HAL status
   */
 static HAL_StatusTypeDef CODEC_IO_Write(cs43l22_HandlerTypeDef *hcs43, uint8_t Reg, uint8_t Value)
 {
-  HAL_StatusTypeDef status = 0;
-  status = AUDIO_IO_Write(hcs43, Reg, Value);
-  if(status) return status;
-  
+  HAL_StatusTypeDef status;
+
+  CODEC_CacheStore(hcs43, Reg, Value);
+
+  if ((hcs43->ioFault) && !(hcs43->ioRecovering)) return CODEC_IO_Faulted(hcs43);
+
+  status = CODEC_IO_Transfer(hcs43, Reg, Value);
+
+#if CS43L22_I2C_AUTO_RECOVERY
+  if ((status != HAL_OK) && !(hcs43->ioRecovering)) status = cs43l22_Recover(hcs43);
+#endif /* CS43L22_I2C_AUTO_RECOVERY */
+
+  return status;
+}
+
+/**
+  * @brief  Reads a single data, with the same retry and recovery policy as
+  *         CODEC_IO_Write().
+  * @param  Reg: Reg address 
+  * @param  Value: Read data
+  * @retval HAL status
+  */
+static HAL_StatusTypeDef CODEC_IO_Read(cs43l22_HandlerTypeDef *hcs43, uint8_t Reg, uint8_t *Value)
+{
+  HAL_StatusTypeDef status;
+  uint8_t attempt;
+
+  if ((hcs43->ioFault) && !(hcs43->ioRecovering))
+  {
+    status = CODEC_IO_Faulted(hcs43);
+    if (status == HAL_OK) status = CODEC_IO_ReadReg(hcs43, Reg, Value);
+    return status;
+  }
+
+  for (attempt = 0; ; attempt++)
+  {
+    status = CODEC_IO_ReadReg(hcs43, Reg, Value);
+    if ((status == HAL_OK) || (attempt >= CODEC_I2C_RETRIES(hcs43))) break;
+
+    CODEC_IO_Backoff(hcs43, attempt);
+  }
+
+#if CS43L22_I2C_AUTO_RECOVERY
+  if ((status != HAL_OK) && !(hcs43->ioRecovering))
+  {
+    status = cs43l22_Recover(hcs43);
+    if (status == HAL_OK) status = CODEC_IO_ReadReg(hcs43, Reg, Value);
+  }
+#endif /* CS43L22_I2C_AUTO_RECOVERY */
+
+  return status;
+}
+
+/**
+  * @brief  Writes a single data, retrying with an exponential backoff.
+  * @param  Reg: Reg address 
+  * @param  Value: Data to be written
+  * @retval HAL status of the last attempt
+  */
+static HAL_StatusTypeDef CODEC_IO_Transfer(cs43l22_HandlerTypeDef *hcs43, uint8_t Reg, uint8_t Value)
+{
+  HAL_StatusTypeDef status;
+  uint8_t attempt;
 #ifdef VERIFY_WRITTENDATA
-  /* Verify that the data has been correctly written */  
-  status = (AUDIO_IO_Read(hcs43, Reg) == Value)? HAL_OK:HAL_ERROR;
+  uint8_t readback;
 #endif /* VERIFY_WRITTENDATA */
-  
+
+  for (attempt = 0; ; attempt++)
+  {
+    status = AUDIO_IO_Write(hcs43, Reg, Value);
+
+#ifdef VERIFY_WRITTENDATA
+    /* Verify that the data has been correctly written */  
+    if (status == HAL_OK) status = CODEC_IO_ReadReg(hcs43, Reg, &readback);
+    if ((status == HAL_OK) && (readback != Value)) status = HAL_ERROR;
+#endif /* VERIFY_WRITTENDATA */
+
+    if ((status == HAL_OK) || (attempt >= CODEC_I2C_RETRIES(hcs43))) break;
+
+    CODEC_IO_Backoff(hcs43, attempt);
+  }
+
+  if (status == HAL_OK)
+  {
+    /* The codec answers again */
+    hcs43->ioFault = 0;
+    if (Reg == CS43L22_REG_CH_MIXER_SWAP) hcs43->hwChannelMap = CODEC_MixerChannelMap(Value);
+  }
+
+  return status;
+}
+
+/**
+  * @brief  Reads a single data through AUDIO_IO_Read().
+  * @param  Reg: Reg address 
+  * @param  Value: Read data
+  * @retval HAL status reported by AUDIO_IO_Read()
+  */
+static HAL_StatusTypeDef CODEC_IO_ReadReg(cs43l22_HandlerTypeDef *hcs43, uint8_t Reg, uint8_t *Value)
+{
+  hcs43->ioReadStatus = HAL_OK;
+  *Value = AUDIO_IO_Read(hcs43, Reg);
+
+  return hcs43->ioReadStatus;
+}
+
+/**
+  * @brief  Writes the register image back to the codec after a recovery.
+  * @note   The codec is held powered down while it is reconfigured, the last
+  *         power state is restored at the end. Stops at the first failure.
+  * @retval HAL status
+  */
+static HAL_StatusTypeDef CODEC_Resync(cs43l22_HandlerTypeDef *hcs43)
+{
+  HAL_StatusTypeDef status = HAL_OK;
+  uint8_t reg;
+
+  if (hcs43->regValid & ((uint64_t)1 << CS43L22_REG_POWER_CTL1))
+  {
+    status = CODEC_IO_Transfer(hcs43, CS43L22_REG_POWER_CTL1, 0x01);
+  }
+
+  for (reg = CS43L22_REG_POWER_CTL1 + 1; (reg < CS43L22_REG_CACHE_SIZE) && (status == HAL_OK); reg++)
+  {
+    if (hcs43->regValid & ((uint64_t)1 << reg))
+    {
+      status = CODEC_IO_Transfer(hcs43, reg, hcs43->regCache[reg]);
+    }
+  }
+
+  if ((status == HAL_OK) && (hcs43->regValid & ((uint64_t)1 << CS43L22_REG_POWER_CTL1)))
+  {
+    status = CODEC_IO_Transfer(hcs43, CS43L22_REG_POWER_CTL1, hcs43->regCache[CS43L22_REG_POWER_CTL1]);
+  }
+
   return status;
 }
 
+/**
+  * @brief  Waits before a retry: the delay doubles on each attempt, up to
+  *         CS43L22_I2C_BACKOFF_MAX.
+  */
+static void CODEC_IO_Backoff(cs43l22_HandlerTypeDef *hcs43, uint8_t Attempt)
+{
+  uint32_t delay = CODEC_I2C_BACKOFF(hcs43);
+
+  while ((Attempt-- != 0) && (delay < CS43L22_I2C_BACKOFF_MAX)) delay <<= 1;
+  if (delay > CS43L22_I2C_BACKOFF_MAX) delay = CS43L22_I2C_BACKOFF_MAX;
+
+  hcs43->ioStats.retries++;
+  HAL_Delay(delay);
+}
+
+/**
+  * @brief  Register access while the codec is unreachable: fails at once,
+  *         unless the last recovery attempt is old enough to try again.
+  * @retval HAL_OK if a new recovery brought the codec back.
+  */
+static HAL_StatusTypeDef CODEC_IO_Faulted(cs43l22_HandlerTypeDef *hcs43)
+{
+#if CS43L22_I2C_AUTO_RECOVERY
+  if ((HAL_GetTick() - hcs43->ioFaultTick) >= CS43L22_I2C_RECOVERY_INTERVAL) return cs43l22_Recover(hcs43);
+#endif /* CS43L22_I2C_AUTO_RECOVERY */
+  return HAL_ERROR;
+}
+
+/**
+  * @brief  Updates the register image without accessing the codec.
+  */
+static void CODEC_CacheStore(cs43l22_HandlerTypeDef *hcs43, uint8_t Reg, uint8_t Value)
+{
+  if (Reg < CS43L22_REG_CACHE_SIZE)
+  {
+    hcs43->regCache[Reg] = Value;
+    hcs43->regValid |= ((uint64_t)1 << Reg);
+  }
+}
+
+/**
+  * @brief  CS43L22_REG_POWER_CTL2 value of an OUTPUT_DEVICE_xxx.
+  */
+static uint8_t CODEC_OutputPower(uint16_t OutputDevice)
+{
+  switch (OutputDevice)
+  {
+  case OUTPUT_DEVICE_SPEAKER:
+    return 0xFA; /* SPK always ON & HP always OFF */
+  case OUTPUT_DEVICE_HEADPHONE:
+    return 0xAF; /* SPK always OFF & HP always ON */
+  case OUTPUT_DEVICE_BOTH:
+    return 0xAA; /* SPK always ON & HP always ON */
+  default:
+    return 0x05; /* Detect the HP or the SPK automatically */
+  }
+}
+
+/**
+  * @brief  Engine used for a routing: CS43L22_ROUTE_HW or CS43L22_ROUTE_SW.
+  */
+static uint8_t CODEC_RouteEngine(cs43l22_HandlerTypeDef *hcs43, const cs43l22_RoutingTypeDef *Routing)
+{
+  if (Routing->engine != CS43L22_ROUTE_AUTO) return Routing->engine;
+  return ((hcs43->ioFault) && CODEC_HAS_REFILL(hcs43))? CS43L22_ROUTE_SW : CS43L22_ROUTE_HW;
+}
+
+/**
+  * @brief  Makes the pending routing current and selects its engine. The
+  *         software downmix takes effect on the next processed block.
+  */
+static void CODEC_SelectRouting(cs43l22_HandlerTypeDef *hcs43)
+{
+  hcs43->routing = hcs43->routingPending;
+  hcs43->routeUpdate = 0;
+  hcs43->routeEngine = CODEC_RouteEngine(hcs43, &hcs43->routing);
+  hcs43->swChannelMap = (hcs43->routeEngine == CS43L22_ROUTE_SW)? CODEC_SoftwareMap(hcs43) : CS43L22_CHMAP_STEREO;
+}
+
+/**
+  * @brief  Channel map of the software engine. The block plays through the
+  *         stereo mixer written for it, or through the mixer left on the
+  *         codec while the bus is faulted: the map is composed with it so
+  *         the channels are not remapped twice.
+  */
+static uint8_t CODEC_SoftwareMap(cs43l22_HandlerTypeDef *hcs43)
+{
+  uint8_t mixer = (hcs43->ioFault)? hcs43->hwChannelMap : CS43L22_CHMAP_STEREO;
+
+  return CODEC_SwChannelMap[mixer][hcs43->routing.channelMap];
+}
+
+/**
+  * @brief  CS43L22_CHMAP_xxx of a CS43L22_REG_CH_MIXER_SWAP value.
+  */
+static uint8_t CODEC_MixerChannelMap(uint8_t Mixer)
+{
+  uint8_t map;
+
+  for (map = CS43L22_CHMAP_STEREO; map <= CS43L22_CHMAP_RIGHT; map++)
+  {
+    if (CODEC_ChannelMixer[map] == Mixer) return map;
+  }
+  return CS43L22_CHMAP_STEREO;
+}
+
+/**
+  * @brief  Programs the codec for a routing.
+  * @param  Routing: Routing to apply, Engine: engine selected for it.
+  * @note   While the codec is unreachable CODEC_IO_Write() only updates the
+  *         register image, the next re-sync writes it.
+  */
+static HAL_StatusTypeDef CODEC_WriteRouting(cs43l22_HandlerTypeDef *hcs43, const cs43l22_RoutingTypeDef *Routing, uint8_t Engine)
+{
+  uint8_t mixer = (Engine == CS43L22_ROUTE_HW)? CODEC_ChannelMixer[Routing->channelMap] : 0x00;
+  uint8_t playback = (Routing->speakerMono)? CODEC_SPEAKER_MONO : 0x00;
+  uint8_t muted = ((hcs43->regValid & ((uint64_t)1 << CS43L22_REG_POWER_CTL2)) &&
+                   (hcs43->regCache[CS43L22_REG_POWER_CTL2] == 0xFF))? 1 : 0;
+  uint8_t err = 0;
+
+  hcs43->outputDevice = CODEC_OutputPower(Routing->outputDevice);
+
+  err += CODEC_IO_Write(hcs43, CS43L22_REG_CH_MIXER_SWAP, mixer);
+  err += CODEC_IO_Write(hcs43, CS43L22_REG_PLAYBACK_CTL2, playback);
+
+  /* A muted codec keeps its outputs off, unmuting powers the new ones */
+  if (!muted) err += CODEC_IO_Write(hcs43, CS43L22_REG_POWER_CTL2, hcs43->outputDevice);
+
+  return (err == 0)? HAL_OK : HAL_ERROR;
+}
+
+/**
+  * @brief  Software downmix, in place on interleaved L, R samples.
+  */
+static void CODEC_Downmix(uint16_t *pBuffer, uint16_t Size, uint8_t ChannelMap)
+{
+  int16_t *pSample = (int16_t *)pBuffer;
+  int16_t *pEnd = pSample + (Size & ~1U);
+  int16_t tmp;
+
+  switch (ChannelMap)
+  {
+  case CS43L22_CHMAP_SWAP:
+    for (; pSample < pEnd; pSample += 2)
+    {
+      tmp = pSample[0];
+      pSample[0] = pSample[1];
+      pSample[1] = tmp;
+    }
+    break;
+
+  case CS43L22_CHMAP_MONO:
+    for (; pSample < pEnd; pSample += 2)
+    {
+      tmp = (int16_t)(((int32_t)pSample[0] + pSample[1]) >> 1);
+      pSample[0] = tmp;
+      pSample[1] = tmp;
+    }
+    break;
+
+  case CS43L22_CHMAP_LEFT:
+    for (; pSample < pEnd; pSample += 2) pSample[1] = pSample[0];
+    break;
+
+  case CS43L22_CHMAP_RIGHT:
+    for (; pSample < pEnd; pSample += 2) pSample[0] = pSample[1];
+    break;
+
+  default:
+    break;
+  }
+}
+
+/**
+  * @brief  Half SCL period wait for the bus recovery.
+  */
+static void CODEC_BusDelay(void)
+{
+  volatile uint32_t index;
+
+  for(index = 0x00; index < CODEC_BUS_RECOVERY_DELAY; index++);
+}
 
 /**
   * @}
@@ -24,6 +24,25 @@
 /* Includes ------------------------------------------------------------------*/
 #include <stm32f4xx_hal.h>
 
+/* Set to 1 to build the thread-safe front end and the audio task, together
+   with one of the cs43l22_os_xxx.c ports */
+#ifndef CS43L22_USE_OS
+#define CS43L22_USE_OS                0
+#endif /* CS43L22_USE_OS */
+
+#if CS43L22_USE_OS
+#include "cs43l22_os.h"
+#endif /* CS43L22_USE_OS */
+
+/* Set to 1 to build the level and spectrum analysis tap on the output stream */
+#ifndef CS43L22_USE_ANALYSIS
+#define CS43L22_USE_ANALYSIS          0
+#endif /* CS43L22_USE_ANALYSIS */
+
+#if CS43L22_USE_ANALYSIS
+#include "cs43l22_analysis.h"
+#endif /* CS43L22_USE_ANALYSIS */
+
 /** @addtogroup BSP
   * @{
   */ 
@@ -73,6 +92,72 @@
 #define AUDIO_MUTE_ON                 1
 #define AUDIO_MUTE_OFF                0
 
+/* Channel map of the DAC inputs (channels A and B) */
+#define CS43L22_CHMAP_STEREO          0       /* A = L, B = R */
+#define CS43L22_CHMAP_SWAP            1       /* A = R, B = L */
+#define CS43L22_CHMAP_MONO            2       /* A = B = (L + R) / 2 */
+#define CS43L22_CHMAP_LEFT            3       /* A = B = L */
+#define CS43L22_CHMAP_RIGHT           4       /* A = B = R */
+
+/* Routing engine */
+#define CS43L22_ROUTE_AUTO            0       /* Codec mixer, software while the control bus is down */
+#define CS43L22_ROUTE_HW              1       /* Codec channel mixer */
+#define CS43L22_ROUTE_SW              2       /* Software downmix of the stream */
+
+/* I2C control path defaults, used when the matching handler field is 0 */
+#ifndef CS43L22_I2C_TIMEOUT
+#define CS43L22_I2C_TIMEOUT           0x1000  /* Per transaction timeout (ms) */
+#endif /* CS43L22_I2C_TIMEOUT */
+#ifndef CS43L22_I2C_RETRIES
+#define CS43L22_I2C_RETRIES           3       /* Retries before a bus recovery */
+#endif /* CS43L22_I2C_RETRIES */
+#ifndef CS43L22_I2C_BACKOFF
+#define CS43L22_I2C_BACKOFF           1       /* First retry delay (ms), doubled on each retry */
+#endif /* CS43L22_I2C_BACKOFF */
+#ifndef CS43L22_I2C_BACKOFF_MAX
+#define CS43L22_I2C_BACKOFF_MAX       100     /* Longest retry delay (ms) */
+#endif /* CS43L22_I2C_BACKOFF_MAX */
+
+/* Once a recovery failed, register accesses fail at once and a new recovery
+   is attempted at most every CS43L22_I2C_RECOVERY_INTERVAL ms */
+#ifndef CS43L22_I2C_RECOVERY_INTERVAL
+#define CS43L22_I2C_RECOVERY_INTERVAL 1000
+#endif /* CS43L22_I2C_RECOVERY_INTERVAL */
+
+/* Set to 0 to disable the automatic bus recovery and codec re-sync */
+#ifndef CS43L22_I2C_AUTO_RECOVERY
+#define CS43L22_I2C_AUTO_RECOVERY     1
+#endif /* CS43L22_I2C_AUTO_RECOVERY */
+
+/* Audio task settings (CS43L22_USE_OS) */
+#ifndef CS43L22_TASK_STACK_SIZE
+#define CS43L22_TASK_STACK_SIZE       1024    /* Bytes, control and refill tasks */
+#endif /* CS43L22_TASK_STACK_SIZE */
+#ifndef CS43L22_TASK_QUEUE_SIZE
+#define CS43L22_TASK_QUEUE_SIZE       8       /* Pending commands, and pending refills */
+#endif /* CS43L22_TASK_QUEUE_SIZE */
+
+/* Audio task messages */
+#define CS43L22_CMD_INIT              1
+#define CS43L22_CMD_DEINIT            2
+#define CS43L22_CMD_READ_ID           3
+#define CS43L22_CMD_STREAM_SOUND      4
+#define CS43L22_CMD_PLAY              5
+#define CS43L22_CMD_PAUSE             6
+#define CS43L22_CMD_RESUME            7
+#define CS43L22_CMD_STOP              8
+#define CS43L22_CMD_SET_VOLUME        9
+#define CS43L22_CMD_SET_FREQUENCY     10
+#define CS43L22_CMD_SET_MUTE          11
+#define CS43L22_CMD_SET_OUTPUT_MODE   12
+#define CS43L22_CMD_RESET             13
+#define CS43L22_CMD_RECOVER           14
+#define CS43L22_CMD_SET_ROUTING       15
+#define CS43L22_CMD_PROCESS           16      /* Codec mixer update latched at a block boundary */
+#define CS43L22_CMD_TX_HALF           0x80    /* First half of the buffer sent */
+#define CS43L22_CMD_TX_CPLT           0x81    /* Second half of the buffer sent */
+#define CS43L22_CMD_TX_ROUTING        0x82    /* Codec mixer update latched by the refill task */
+
 /* AUDIO FREQUENCY */
 #define AUDIO_FREQUENCY_192K          ((uint32_t)192000)
 #define AUDIO_FREQUENCY_96K           ((uint32_t)96000)
@@ -124,6 +209,9 @@
 #define   CS43L22_REG_THERMAL_FOLDBACK    0x33
 #define   CS43L22_REG_CHARGE_PUMP_FREQ    0x34
 
+/* Number of registers mirrored by the driver for the codec re-sync */
+#define   CS43L22_REG_CACHE_SIZE          (CS43L22_REG_CHARGE_PUMP_FREQ + 1)
+
 /******************************************************************************/
 /****************************** REGISTER MAPPING ******************************/
 /******************************************************************************/
@@ -168,6 +256,21 @@
 ------------------------------------------------------------------------------*/
 
 typedef struct {
+  uint32_t retries;           /* Transactions repeated after a failure */
+  uint32_t recoveries;        /* Bus recoveries performed */
+  uint32_t failures;          /* Recoveries that did not bring the codec back */
+  uint32_t lastRecoveryTime;  /* Duration of the last recovery and re-sync (ms) */
+  uint32_t maxRecoveryTime;   /* Longest recovery and re-sync seen (ms) */
+} cs43l22_IOStatsTypeDef;
+
+typedef struct {
+  uint8_t outputDevice;       /* OUTPUT_DEVICE_xxx */
+  uint8_t channelMap;         /* CS43L22_CHMAP_xxx */
+  uint8_t speakerMono;        /* 1: speaker in parallel full-bridge mono mode */
+  uint8_t engine;             /* CS43L22_ROUTE_xxx */
+} cs43l22_RoutingTypeDef;
+
+typedef struct __cs43l22_HandlerTypeDef {
   uint16_t deviceAddr;
   I2C_HandleTypeDef *hi2c;
   I2S_HandleTypeDef *hi2s;
@@ -175,6 +278,67 @@ typedef struct {
   uint8_t volume;
   uint8_t outputDevice;
   uint32_t audioFrequency;
+
+  /* Buffer handed to cs43l22_StreamSound() */
+  uint16_t *txBuffer;
+  uint16_t txSize;
+
+  /* Output routing, see cs43l22_SetRouting() */
+  cs43l22_RoutingTypeDef routing;
+  cs43l22_RoutingTypeDef routingPending;
+  uint8_t routeUpdate;        /* routingPending waits for a block boundary */
+  uint8_t routeHwUpdate;      /* Codec mixer update due at the next boundary */
+  uint8_t routeHwReady;       /* routeHw and routeHwEngine wait for cs43l22_Process() */
+  cs43l22_RoutingTypeDef routeHw;
+  uint8_t routeHwEngine;
+  uint8_t routeEngine;        /* Engine in use, CS43L22_ROUTE_HW or _SW */
+  uint8_t swChannelMap;       /* Channel map applied by the software downmix */
+  uint8_t hwChannelMap;       /* Channel map last written to the codec mixer */
+
+#if CS43L22_USE_ANALYSIS
+  /* Analysis tap, fed with every released half of the DMA buffer (optional) */
+  cs43l22_AnalysisTypeDef *analysis;
+#endif /* CS43L22_USE_ANALYSIS */
+
+  /* I2C control path settings (0 selects the CS43L22_I2C_xxx default) */
+  uint32_t i2cTimeout;
+  uint8_t i2cRetries;
+  uint8_t i2cBackoff;
+
+  /* SCL/SDA pins used for the bus recovery (optional, sclPort == NULL
+     only re-initializes the I2C peripheral) */
+  GPIO_TypeDef *sclPort;
+  uint16_t sclPin;
+  GPIO_TypeDef *sdaPort;
+  uint16_t sdaPin;
+
+  /* Status of the last AUDIO_IO_Read(), set by the read hook */
+  HAL_StatusTypeDef ioReadStatus;
+
+  /* Driver private state */
+  uint8_t ioRecovering;
+  uint8_t ioFault;            /* Last recovery failed, the codec is unreachable */
+  uint32_t ioFaultTick;       /* HAL tick of the last failed recovery */
+  uint64_t regValid;
+  uint8_t regCache[CS43L22_REG_CACHE_SIZE];
+  cs43l22_IOStatsTypeDef ioStats;
+
+  /* Called by cs43l22_TxBlock() to refill the half of the buffer DMA just
+     released (Size in samples). Must not call the driver API. */
+  void (*TxRefillCallback)(struct __cs43l22_HandlerTypeDef *hcs43, uint16_t *pBuffer, uint16_t Size);
+
+#if CS43L22_USE_OS
+  /* Audio task private state */
+  cs43l22_os_thread_t task;           /* Control task, owns the I2C bus */
+  cs43l22_os_queue_t queue;
+  cs43l22_os_thread_t refillTask;     /* Refill task, never waits on the bus */
+  cs43l22_os_queue_t refillQueue;
+  cs43l22_os_mutex_t apiMutex;
+  cs43l22_os_mutex_t routeMutex;      /* Routing state shared by both tasks */
+  cs43l22_os_sem_t cmdDone;
+  uint32_t cmdResult;
+  uint32_t missedRefills;
+#endif /* CS43L22_USE_OS */
 } cs43l22_HandlerTypeDef;
 
 /*------------------------------------------------------------------------------
@@ -194,6 +358,16 @@ HAL_StatusTypeDef cs43l22_SetFrequency(cs43l22_HandlerTypeDef*, uint32_t AudioFr
 HAL_StatusTypeDef cs43l22_SetMute(cs43l22_HandlerTypeDef*, uint8_t Cmd);
 HAL_StatusTypeDef cs43l22_SetOutputMode(cs43l22_HandlerTypeDef*, uint8_t Output);
 HAL_StatusTypeDef cs43l22_Reset(cs43l22_HandlerTypeDef*);
+HAL_StatusTypeDef cs43l22_Recover(cs43l22_HandlerTypeDef*);
+HAL_StatusTypeDef cs43l22_SetRouting(cs43l22_HandlerTypeDef*, const cs43l22_RoutingTypeDef *Routing);
+HAL_StatusTypeDef cs43l22_RouteBlock(cs43l22_HandlerTypeDef*, uint16_t *pBuffer, uint16_t Size);
+HAL_StatusTypeDef cs43l22_Process(cs43l22_HandlerTypeDef*);
+void              cs43l22_TxBlock(cs43l22_HandlerTypeDef*, uint16_t *pBlock, uint16_t Size);
+
+/* DMA hooks, to be called from HAL_I2S_TxHalfCpltCallback() and
+   HAL_I2S_TxCpltCallback() */
+void              cs43l22_TxHalfCpltISR(cs43l22_HandlerTypeDef*);
+void              cs43l22_TxCpltISR(cs43l22_HandlerTypeDef*);
 
 /* AUDIO IO functions */
 HAL_StatusTypeDef AUDIO_IO_Init(cs43l22_HandlerTypeDef*);
@@ -201,8 +375,16 @@ HAL_StatusTypeDef AUDIO_IO_DeInit(cs43l22_HandlerTypeDef*);
 HAL_StatusTypeDef AUDIO_IO_Check(cs43l22_HandlerTypeDef*);
 HAL_StatusTypeDef AUDIO_IO_Write(cs43l22_HandlerTypeDef*, uint8_t Reg, uint8_t Value);
 uint8_t           AUDIO_IO_Read(cs43l22_HandlerTypeDef*, uint8_t Reg);
+HAL_StatusTypeDef AUDIO_IO_BusRecover(cs43l22_HandlerTypeDef*);
 HAL_StatusTypeDef AUDIO_IO_SetFrequency(cs43l22_HandlerTypeDef*, uint32_t AudioFreq);
 
+#if CS43L22_USE_OS
+/* Audio task functions */
+HAL_StatusTypeDef cs43l22_TaskStart(cs43l22_HandlerTypeDef*);
+uint8_t           cs43l22_IsRemote(cs43l22_HandlerTypeDef*);
+uint32_t          cs43l22_Dispatch(cs43l22_HandlerTypeDef*, uint8_t Cmd, uint32_t Arg0, uint32_t Arg1, uint32_t Arg2, void *Ptr);
+#endif /* CS43L22_USE_OS */
+
 /* Audio driver structure */
 
 #endif /* __CS43L22_H */
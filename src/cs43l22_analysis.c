@@ -0,0 +1,435 @@
+/**
+  ******************************************************************************
+  * @file    cs43l22_analysis.c
+  * @brief   Level metering and spectrum analysis of the CS43L22 output stream.
+  *          Each block on its way to DMA gives the RMS and peak level of both
+  *          channels. The stream is also folded to mono, low-passed and
+  *          decimated and, every CS43L22_FFT_SIZE samples, Hann windowed and
+  *          run through a radix-4 Q15 FFT. Results are published through a double buffer so a
+  *          reader never blocks the audio path.
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include "cs43l22.h"
+
+#if CS43L22_USE_ANALYSIS
+
+#include <string.h>
+
+/** @addtogroup BSP
+  * @{
+  */
+
+/** @addtogroup Components
+  * @{
+  */
+
+/** @addtogroup CS43L22
+  * @{
+  */
+
+/** @defgroup CS43L22_Analysis_Private_Defines
+  * @{
+  */
+#define FFT_TABLE_SIZE      1024    /* Sine table resolution, in steps per turn */
+
+/* DC gain of the anti-alias filter, including the L + R fold. The sinc^2
+   response leaves the upper FFT bins about 7 dB down and only attenuates
+   what folds onto them: the top of the spectrum still carries some alias. */
+#define CIC_GAIN            (CS43L22_FFT_DECIMATION * CS43L22_FFT_DECIMATION * CS43L22_ANALYSIS_CHANNELS)
+
+/* Cycle counter used for the block budget, the DWT counter by default */
+#ifndef CS43L22_ANALYSIS_CYCLES
+#define CS43L22_ANALYSIS_CYCLES()       (DWT->CYCCNT)
+#define CS43L22_ANALYSIS_CYCLES_INIT()  do { CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk; \
+                                             DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk; } while (0)
+#endif /* CS43L22_ANALYSIS_CYCLES */
+#ifndef CS43L22_ANALYSIS_CYCLES_INIT
+#define CS43L22_ANALYSIS_CYCLES_INIT()
+#endif /* CS43L22_ANALYSIS_CYCLES_INIT */
+
+#if (CS43L22_FFT_SIZE != 16) && (CS43L22_FFT_SIZE != 64) && (CS43L22_FFT_SIZE != 256) && (CS43L22_FFT_SIZE != 1024)
+#error "CS43L22_FFT_SIZE must be 16, 64, 256 or 1024"
+#endif
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_Analysis_Private_Variables
+  * @{
+  */
+
+/* sin(2*pi*k/1024) in Q15, first quarter turn */
+static const int16_t FFT_SinTable[FFT_TABLE_SIZE / 4 + 1] = {
+       0,    201,    402,    603,    804,   1005,   1206,   1407,   1608,   1809,   2009,   2210,
+    2411,   2611,   2811,   3012,   3212,   3412,   3612,   3812,   4011,   4211,   4410,   4609,
+    4808,   5007,   5205,   5404,   5602,   5800,   5998,   6195,   6393,   6590,   6787,   6983,
+    7180,   7376,   7571,   7767,   7962,   8157,   8351,   8546,   8740,   8933,   9127,   9319,
+    9512,   9704,   9896,  10088,  10279,  10469,  10660,  10850,  11039,  11228,  11417,  11605,
+   11793,  11980,  12167,  12354,  12540,  12725,  12910,  13095,  13279,  13463,  13646,  13828,
+   14010,  14192,  14373,  14553,  14733,  14912,  15091,  15269,  15447,  15624,  15800,  15976,
+   16151,  16326,  16500,  16673,  16846,  17018,  17190,  17361,  17531,  17700,  17869,  18037,
+   18205,  18372,  18538,  18703,  18868,  19032,  19195,  19358,  19520,  19681,  19841,  20001,
+   20160,  20318,  20475,  20632,  20788,  20943,  21097,  21251,  21403,  21555,  21706,  21856,
+   22006,  22154,  22302,  22449,  22595,  22740,  22884,  23028,  23170,  23312,  23453,  23593,
+   23732,  23870,  24008,  24144,  24279,  24414,  24548,  24680,  24812,  24943,  25073,  25202,
+   25330,  25457,  25583,  25708,  25833,  25956,  26078,  26199,  26320,  26439,  26557,  26674,
+   26791,  26906,  27020,  27133,  27246,  27357,  27467,  27576,  27684,  27791,  27897,  28002,
+   28106,  28209,  28311,  28411,  28511,  28610,  28707,  28803,  28899,  28993,  29086,  29178,
+   29269,  29359,  29448,  29535,  29622,  29707,  29792,  29875,  29957,  30038,  30118,  30196,
+   30274,  30350,  30425,  30499,  30572,  30644,  30715,  30784,  30853,  30920,  30986,  31050,
+   31114,  31177,  31238,  31298,  31357,  31415,  31471,  31527,  31581,  31634,  31686,  31737,
+   31786,  31834,  31881,  31927,  31972,  32015,  32058,  32099,  32138,  32177,  32214,  32251,
+   32286,  32319,  32352,  32383,  32413,  32442,  32470,  32496,  32522,  32546,  32568,  32590,
+   32610,  32629,  32647,  32664,  32679,  32693,  32706,  32718,  32729,  32738,  32746,  32753,
+   32758,  32762,  32766,  32767,  32767
+};
+
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_Analysis_Function_Prototypes
+  * @{
+  */
+static int16_t  FFT_Sin(uint32_t Angle);
+static int16_t  FFT_Sat(int32_t Value);
+static uint32_t FFT_Sqrt(uint32_t Value);
+static void     FFT_Radix4(int16_t *pData);
+static void     ANALYSIS_Spectrum(cs43l22_AnalysisTypeDef *hana);
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_Analysis_Functions
+  * @{
+  */
+
+/**
+  * @brief Resets the analysis state and starts the cycle counter.
+  * @param CycleBudget: CPU cycles allowed per block, 0 for no budget.
+  */
+void cs43l22_Analysis_Init(cs43l22_AnalysisTypeDef *hana, uint32_t CycleBudget)
+{
+  memset(hana, 0, sizeof(cs43l22_AnalysisTypeDef));
+  hana->cycleBudget = CycleBudget;
+
+  CS43L22_ANALYSIS_CYCLES_INIT();
+}
+
+/**
+  * @brief Analyses a block of interleaved stereo samples and publishes the
+  *        result.
+  * @note  Single producer: called by cs43l22_TxBlock() for each released
+  *        half of the DMA buffer (refill task, or DMA callbacks without OS).
+  * @param pBuffer: Block about to be sent, 16-bit samples L, R, L, R...
+  * @param Size: Number of samples in pBuffer.
+  */
+void cs43l22_Analysis_Process(cs43l22_AnalysisTypeDef *hana, const uint16_t *pBuffer, uint16_t Size)
+{
+  cs43l22_AnalysisResultTypeDef *pResult;
+  uint32_t start = CS43L22_ANALYSIS_CYCLES();
+  uint32_t frames = Size / CS43L22_ANALYSIS_CHANNELS;
+  uint64_t energy[CS43L22_ANALYSIS_CHANNELS] = {0};
+  uint16_t peak[CS43L22_ANALYSIS_CHANNELS] = {0};
+  uint32_t elapsed;
+  uint32_t i;
+  uint8_t ch;
+  int32_t sample;
+  uint16_t level;
+  uint32_t comb0, comb1;
+
+  /* An FFT deferred by the previous block goes first, unless it would not
+     fit even in a whole block: the frame is then dropped */
+  if (hana->frameFill == CS43L22_FFT_SIZE)
+  {
+    if ((hana->cycleBudget == 0) || (hana->fftCycles <= hana->cycleBudget))
+    {
+      ANALYSIS_Spectrum(hana);
+    }
+    else
+    {
+      hana->frameFill = 0;
+      hana->droppedFrames++;
+    }
+  }
+
+  for (i = 0; i < frames; i++)
+  {
+    int32_t mono = 0;
+
+    for (ch = 0; ch < CS43L22_ANALYSIS_CHANNELS; ch++)
+    {
+      sample = (int16_t)pBuffer[i * CS43L22_ANALYSIS_CHANNELS + ch];
+      level = (uint16_t)((sample < 0)? -sample : sample);
+      if (level > peak[ch]) peak[ch] = level;
+      energy[ch] += (uint32_t)(sample * sample);
+      mono += sample;
+    }
+
+    /* Anti-alias filter of the FFT feed: 2nd order CIC (sinc^2 response)
+       decimating by CS43L22_FFT_DECIMATION. The integrators wrap modulo
+       2^32, the combs cancel it out. */
+    hana->cicInteg[0] += (uint32_t)mono;
+    hana->cicInteg[1] += hana->cicInteg[0];
+    if (++hana->decimCount == CS43L22_FFT_DECIMATION)
+    {
+      comb0 = hana->cicInteg[1] - hana->cicComb[0];
+      hana->cicComb[0] = hana->cicInteg[1];
+      comb1 = comb0 - hana->cicComb[1];
+      hana->cicComb[1] = comb0;
+      hana->decimCount = 0;
+
+      /* Decimated mono feed of the FFT frame, dropped while an FFT is pending */
+      if (hana->frameFill < CS43L22_FFT_SIZE)
+      {
+        hana->frame[2 * hana->frameFill] = (int16_t)((int32_t)comb1 / CIC_GAIN);
+        hana->frame[2 * hana->frameFill + 1] = 0;
+        hana->frameFill++;
+      }
+    }
+  }
+
+  /* Run the FFT if it still fits the budget, else leave it to the next block */
+  if (hana->frameFill == CS43L22_FFT_SIZE)
+  {
+    elapsed = CS43L22_ANALYSIS_CYCLES() - start;
+    if ((hana->cycleBudget == 0) || (elapsed + hana->fftCycles <= hana->cycleBudget))
+    {
+      ANALYSIS_Spectrum(hana);
+    }
+  }
+
+  /* Fill the back buffer, then make it the front one */
+  pResult = &hana->result[(hana->sequence + 1) & 1];
+  for (ch = 0; ch < CS43L22_ANALYSIS_CHANNELS; ch++)
+  {
+    pResult->rms[ch] = (frames != 0)? (uint16_t)FFT_Sqrt((uint32_t)(energy[ch] / frames)) : 0;
+    pResult->peak[ch] = peak[ch];
+  }
+  memcpy(pResult->spectrum, hana->spectrum, sizeof(pResult->spectrum));
+  pResult->spectrumCount = hana->spectrumCount;
+
+  elapsed = CS43L22_ANALYSIS_CYCLES() - start;
+  if (elapsed > hana->maxCycles) hana->maxCycles = elapsed;
+  if ((hana->cycleBudget != 0) && (elapsed > hana->cycleBudget)) hana->overruns++;
+
+  pResult->cycles = elapsed;
+  pResult->maxCycles = hana->maxCycles;
+  pResult->overruns = hana->overruns;
+  pResult->droppedFrames = hana->droppedFrames;
+  pResult->sequence = hana->sequence + 1;
+
+  __DMB();
+  hana->sequence = hana->sequence + 1;
+}
+
+/**
+  * @brief Copies the last published result.
+  * @note  Lock-free: the copy is retried when the producer published in the
+  *        meantime. Safe from any thread.
+  * @retval HAL_OK, or HAL_BUSY if no consistent copy could be taken.
+  */
+HAL_StatusTypeDef cs43l22_Analysis_Read(const cs43l22_AnalysisTypeDef *hana, cs43l22_AnalysisResultTypeDef *pResult)
+{
+  uint32_t sequence;
+  uint8_t attempt;
+
+  for (attempt = 0; attempt < 4; attempt++)
+  {
+    sequence = hana->sequence;
+    __DMB();
+    memcpy(pResult, &hana->result[sequence & 1], sizeof(cs43l22_AnalysisResultTypeDef));
+    __DMB();
+    if (hana->sequence == sequence) return HAL_OK;
+  }
+  return HAL_BUSY;
+}
+
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_Analysis_Private_Functions
+  * @{
+  */
+
+/**
+  * @brief Windows and transforms the full frame, then updates the spectrum.
+  */
+static void ANALYSIS_Spectrum(cs43l22_AnalysisTypeDef *hana)
+{
+  uint32_t start = CS43L22_ANALYSIS_CYCLES();
+  uint32_t step = FFT_TABLE_SIZE / CS43L22_FFT_SIZE;
+  int32_t re, im, mx, mn;
+  uint32_t n;
+
+  /* Hann window: (1 - cos) / 2 */
+  for (n = 0; n < CS43L22_FFT_SIZE; n++)
+  {
+    int32_t w = (32767 - FFT_Sin(n * step + FFT_TABLE_SIZE / 4)) >> 1;
+    hana->frame[2 * n] = (int16_t)((hana->frame[2 * n] * w) >> 15);
+  }
+
+  FFT_Radix4(hana->frame);
+
+  /* |X| ~ max + 3/8 min */
+  for (n = 0; n < CS43L22_FFT_SIZE / 2; n++)
+  {
+    re = hana->frame[2 * n];
+    im = hana->frame[2 * n + 1];
+    if (re < 0) re = -re;
+    if (im < 0) im = -im;
+    mx = (re > im)? re : im;
+    mn = (re > im)? im : re;
+    mx += (mn >> 2) + (mn >> 3);
+    hana->spectrum[n] = (uint16_t)((mx > 0xFFFF)? 0xFFFF : mx);
+  }
+
+  hana->spectrumCount++;
+  hana->frameFill = 0;
+  hana->fftCycles = CS43L22_ANALYSIS_CYCLES() - start;
+}
+
+/**
+  * @brief In-place radix-4 decimation in frequency FFT, Q15. Each stage
+  *        scales by 1/4 so the output is X[k] / N.
+  * @param pData: CS43L22_FFT_SIZE complex samples (re, im).
+  */
+static void FFT_Radix4(int16_t *pData)
+{
+  uint32_t len, quarter, step, k, g, i, j, rev;
+  int32_t ar, ai, br, bi, cr, ci, dr, di;
+  int32_t t0r, t0i, t1r, t1i, t2r, t2i, t3r, t3i;
+  int32_t yr, yi;
+  int32_t c1, s1, c2, s2, c3, s3;
+  int16_t tmp;
+
+  for (len = CS43L22_FFT_SIZE; len >= 4; len >>= 2)
+  {
+    quarter = len >> 2;
+    step = FFT_TABLE_SIZE / len;
+
+    for (k = 0; k < quarter; k++)
+    {
+      /* W^k, W^2k, W^3k of this stage */
+      c1 = FFT_Sin(k * step + FFT_TABLE_SIZE / 4);      s1 = FFT_Sin(k * step);
+      c2 = FFT_Sin(2 * k * step + FFT_TABLE_SIZE / 4);  s2 = FFT_Sin(2 * k * step);
+      c3 = FFT_Sin(3 * k * step + FFT_TABLE_SIZE / 4);  s3 = FFT_Sin(3 * k * step);
+
+      for (g = k; g < CS43L22_FFT_SIZE; g += len)
+      {
+        ar = pData[2 * g] >> 2;                   ai = pData[2 * g + 1] >> 2;
+        br = pData[2 * (g + quarter)] >> 2;       bi = pData[2 * (g + quarter) + 1] >> 2;
+        cr = pData[2 * (g + 2 * quarter)] >> 2;   ci = pData[2 * (g + 2 * quarter) + 1] >> 2;
+        dr = pData[2 * (g + 3 * quarter)] >> 2;   di = pData[2 * (g + 3 * quarter) + 1] >> 2;
+
+        t0r = ar + cr;  t0i = ai + ci;
+        t1r = ar - cr;  t1i = ai - ci;
+        t2r = br + dr;  t2i = bi + di;
+        t3r = br - dr;  t3i = bi - di;
+
+        /* y0 = t0 + t2 */
+        pData[2 * g] = FFT_Sat(t0r + t2r);
+        pData[2 * g + 1] = FFT_Sat(t0i + t2i);
+
+        /* y1 = (t1 - j t3) W^k */
+        i = g + quarter;
+        yr = t1r + t3i;  yi = t1i - t3r;
+        pData[2 * i] = FFT_Sat((yr * c1 + yi * s1 + 0x4000) >> 15);
+        pData[2 * i + 1] = FFT_Sat((yi * c1 - yr * s1 + 0x4000) >> 15);
+
+        /* y2 = (t0 - t2) W^2k */
+        i += quarter;
+        yr = t0r - t2r;  yi = t0i - t2i;
+        pData[2 * i] = FFT_Sat((yr * c2 + yi * s2 + 0x4000) >> 15);
+        pData[2 * i + 1] = FFT_Sat((yi * c2 - yr * s2 + 0x4000) >> 15);
+
+        /* y3 = (t1 + j t3) W^3k */
+        i += quarter;
+        yr = t1r - t3i;  yi = t1i + t3r;
+        pData[2 * i] = FFT_Sat((yr * c3 + yi * s3 + 0x4000) >> 15);
+        pData[2 * i + 1] = FFT_Sat((yi * c3 - yr * s3 + 0x4000) >> 15);
+      }
+    }
+  }
+
+  /* Base-4 digit reversal */
+  for (i = 0; i < CS43L22_FFT_SIZE; i++)
+  {
+    rev = 0;
+    for (j = i, k = 1; k < CS43L22_FFT_SIZE; k <<= 2, j >>= 2)
+    {
+      rev = (rev << 2) | (j & 3);
+    }
+    if (rev > i)
+    {
+      tmp = pData[2 * i];     pData[2 * i] = pData[2 * rev];         pData[2 * rev] = tmp;
+      tmp = pData[2 * i + 1]; pData[2 * i + 1] = pData[2 * rev + 1]; pData[2 * rev + 1] = tmp;
+    }
+  }
+}
+
+/**
+  * @brief sin(2*pi*Angle/FFT_TABLE_SIZE) in Q15.
+  */
+static int16_t FFT_Sin(uint32_t Angle)
+{
+  Angle &= FFT_TABLE_SIZE - 1;
+
+  if (Angle <= FFT_TABLE_SIZE / 4) return FFT_SinTable[Angle];
+  if (Angle <= FFT_TABLE_SIZE / 2) return FFT_SinTable[FFT_TABLE_SIZE / 2 - Angle];
+  if (Angle <= 3 * FFT_TABLE_SIZE / 4) return (int16_t)-FFT_SinTable[Angle - FFT_TABLE_SIZE / 2];
+  return (int16_t)-FFT_SinTable[FFT_TABLE_SIZE - Angle];
+}
+
+static int16_t FFT_Sat(int32_t Value)
+{
+  if (Value > 32767) return 32767;
+  if (Value < -32768) return -32768;
+  return (int16_t)Value;
+}
+
+/**
+  * @brief Integer square root.
+  */
+static uint32_t FFT_Sqrt(uint32_t Value)
+{
+  uint32_t root = 0;
+  uint32_t bit = 1UL << 30;
+
+  while (bit > Value) bit >>= 2;
+  while (bit != 0)
+  {
+    if (Value >= root + bit)
+    {
+      Value -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else
+    {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+#endif /* CS43L22_USE_ANALYSIS */
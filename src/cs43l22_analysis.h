@@ -0,0 +1,95 @@
+/**
+  ******************************************************************************
+  * @file    cs43l22_analysis.h
+  * @brief   Level metering and spectrum analysis of the CS43L22 output stream
+  *          (CS43L22_USE_ANALYSIS).
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __CS43L22_ANALYSIS_H
+#define __CS43L22_ANALYSIS_H
+
+/* Includes ------------------------------------------------------------------*/
+#include <stm32f4xx_hal.h>
+
+/** @addtogroup CS43L22
+  * @{
+  */
+
+/** @defgroup CS43L22_Analysis_Exported_Constants
+  * @{
+  */
+#define CS43L22_ANALYSIS_CHANNELS     2       /* Interleaved stereo stream */
+
+/* FFT length, a power of 4: 16, 64, 256 or 1024 */
+#ifndef CS43L22_FFT_SIZE
+#define CS43L22_FFT_SIZE              256
+#endif /* CS43L22_FFT_SIZE */
+
+/* Decimation of the FFT feed, in stereo frames per FFT input sample */
+#ifndef CS43L22_FFT_DECIMATION
+#define CS43L22_FFT_DECIMATION        4
+#endif /* CS43L22_FFT_DECIMATION */
+
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_Analysis_Exported_Types
+  * @{
+  */
+typedef struct {
+  uint32_t sequence;                            /* Publication counter */
+  uint16_t rms[CS43L22_ANALYSIS_CHANNELS];      /* Block RMS level, Q15 */
+  uint16_t peak[CS43L22_ANALYSIS_CHANNELS];     /* Block peak level, Q15 */
+  uint16_t spectrum[CS43L22_FFT_SIZE / 2];      /* Bin magnitude of the last FFT, Q15 scaled by 1/N */
+  uint32_t spectrumCount;                       /* Number of FFTs computed */
+  uint32_t cycles;                              /* CPU cycles spent on the block */
+  uint32_t maxCycles;                           /* Worst block so far */
+  uint32_t overruns;                            /* Blocks that exceeded the budget */
+  uint32_t droppedFrames;                       /* FFT frames dropped by the budget */
+} cs43l22_AnalysisResultTypeDef;
+
+typedef struct {
+  /* Cycles allowed per block (0: no budget). An FFT that does not fit the
+     budget left in the block is deferred to the next one, where it is
+     dropped if its last measured cost exceeds the whole budget. */
+  uint32_t cycleBudget;
+
+  /* Private state */
+  int16_t frame[2 * CS43L22_FFT_SIZE];          /* Complex FFT buffer (re, im) */
+  uint16_t frameFill;
+  uint32_t cicInteg[2];                         /* Anti-alias filter state */
+  uint32_t cicComb[2];
+  uint16_t decimCount;
+  uint32_t fftCycles;
+  uint16_t spectrum[CS43L22_FFT_SIZE / 2];
+  uint32_t spectrumCount;
+  uint32_t maxCycles;
+  uint32_t overruns;
+  uint32_t droppedFrames;
+  cs43l22_AnalysisResultTypeDef result[2];      /* Published double buffer */
+  volatile uint32_t sequence;
+} cs43l22_AnalysisTypeDef;
+
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_Analysis_Exported_Functions
+  * @{
+  */
+void              cs43l22_Analysis_Init(cs43l22_AnalysisTypeDef*, uint32_t CycleBudget);
+void              cs43l22_Analysis_Process(cs43l22_AnalysisTypeDef*, const uint16_t *pBuffer, uint16_t Size);
+HAL_StatusTypeDef cs43l22_Analysis_Read(const cs43l22_AnalysisTypeDef*, cs43l22_AnalysisResultTypeDef *pResult);
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+#endif /* __CS43L22_ANALYSIS_H */
@@ -0,0 +1,83 @@
+/**
+  ******************************************************************************
+  * @file    cs43l22_os.h
+  * @brief   Operating system abstraction used by the CS43L22 audio task.
+  *          One port is selected at build time:
+  *            - CS43L22_OS_CMSIS2: CMSIS-RTOS2 (cs43l22_os_cmsis2.c)
+  *            - CS43L22_OS_POSIX:  pthreads, for host testing (cs43l22_os_posix.c)
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __CS43L22_OS_H
+#define __CS43L22_OS_H
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/** @addtogroup CS43L22
+  * @{
+  */
+
+/** @defgroup CS43L22_OS_Exported_Types
+  * @{
+  */
+typedef void *cs43l22_os_mutex_t;
+typedef void *cs43l22_os_sem_t;
+typedef void *cs43l22_os_queue_t;
+typedef void *cs43l22_os_thread_t;
+
+typedef enum {
+  CS43L22_OS_OK = 0,
+  CS43L22_OS_ERROR,
+  CS43L22_OS_TIMEOUT
+} cs43l22_OSStatusTypeDef;
+
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_OS_Exported_Constants
+  * @{
+  */
+#define CS43L22_OS_WAIT_FOREVER       0xFFFFFFFFU
+
+/* Thread priorities */
+#define CS43L22_OS_PRIO_NORMAL        0
+#define CS43L22_OS_PRIO_HIGH          1
+
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_OS_Exported_Functions
+  * @{
+  */
+/* Timeouts are given in milliseconds. Functions marked (ISR) may be called
+   from interrupt context with a timeout of 0. */
+cs43l22_os_mutex_t      cs43l22_OS_MutexCreate(void);
+cs43l22_OSStatusTypeDef cs43l22_OS_MutexLock(cs43l22_os_mutex_t Mutex, uint32_t Timeout);
+cs43l22_OSStatusTypeDef cs43l22_OS_MutexUnlock(cs43l22_os_mutex_t Mutex);
+
+cs43l22_os_sem_t        cs43l22_OS_SemCreate(uint32_t MaxCount, uint32_t InitCount);
+cs43l22_OSStatusTypeDef cs43l22_OS_SemTake(cs43l22_os_sem_t Sem, uint32_t Timeout);
+cs43l22_OSStatusTypeDef cs43l22_OS_SemGive(cs43l22_os_sem_t Sem);                              /* (ISR) */
+
+cs43l22_os_queue_t      cs43l22_OS_QueueCreate(uint32_t Count, uint32_t MsgSize);
+cs43l22_OSStatusTypeDef cs43l22_OS_QueuePut(cs43l22_os_queue_t Queue, const void *pMsg, uint32_t Timeout); /* (ISR) */
+cs43l22_OSStatusTypeDef cs43l22_OS_QueueGet(cs43l22_os_queue_t Queue, void *pMsg, uint32_t Timeout);
+
+cs43l22_os_thread_t     cs43l22_OS_ThreadCreate(const char *Name, void (*Func)(void *), void *Arg,
+                                                uint32_t StackSize, uint8_t Prio);
+cs43l22_os_thread_t     cs43l22_OS_ThreadSelf(void);
+uint8_t                 cs43l22_OS_InISR(void);
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+#endif /* __CS43L22_OS_H */
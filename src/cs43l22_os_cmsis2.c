@@ -0,0 +1,114 @@
+/**
+  ******************************************************************************
+  * @file    cs43l22_os_cmsis2.c
+  * @brief   CMSIS-RTOS2 port of the CS43L22 operating system abstraction.
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include "cs43l22_os.h"
+
+#if defined(CS43L22_OS_CMSIS2)
+
+#include <stm32f4xx_hal.h>
+#include "cmsis_os2.h"
+
+/** @addtogroup CS43L22
+  * @{
+  */
+
+/** @defgroup CS43L22_OS_CMSIS2_Private_Functions
+  * @{
+  */
+
+static uint32_t OS_Ticks(uint32_t Timeout)
+{
+  if (Timeout == CS43L22_OS_WAIT_FOREVER) return osWaitForever;
+  return (uint32_t)(((uint64_t)Timeout * osKernelGetTickFreq() + 999U) / 1000U);
+}
+
+static cs43l22_OSStatusTypeDef OS_Status(osStatus_t status)
+{
+  if (status == osOK) return CS43L22_OS_OK;
+  if ((status == osErrorTimeout) || (status == osErrorResource)) return CS43L22_OS_TIMEOUT;
+  return CS43L22_OS_ERROR;
+}
+
+cs43l22_os_mutex_t cs43l22_OS_MutexCreate(void)
+{
+  const osMutexAttr_t attr = { .name = "cs43l22", .attr_bits = osMutexPrioInherit };
+
+  return osMutexNew(&attr);
+}
+
+cs43l22_OSStatusTypeDef cs43l22_OS_MutexLock(cs43l22_os_mutex_t Mutex, uint32_t Timeout)
+{
+  return OS_Status(osMutexAcquire((osMutexId_t)Mutex, OS_Ticks(Timeout)));
+}
+
+cs43l22_OSStatusTypeDef cs43l22_OS_MutexUnlock(cs43l22_os_mutex_t Mutex)
+{
+  return OS_Status(osMutexRelease((osMutexId_t)Mutex));
+}
+
+cs43l22_os_sem_t cs43l22_OS_SemCreate(uint32_t MaxCount, uint32_t InitCount)
+{
+  return osSemaphoreNew(MaxCount, InitCount, NULL);
+}
+
+cs43l22_OSStatusTypeDef cs43l22_OS_SemTake(cs43l22_os_sem_t Sem, uint32_t Timeout)
+{
+  return OS_Status(osSemaphoreAcquire((osSemaphoreId_t)Sem, OS_Ticks(Timeout)));
+}
+
+cs43l22_OSStatusTypeDef cs43l22_OS_SemGive(cs43l22_os_sem_t Sem)
+{
+  return OS_Status(osSemaphoreRelease((osSemaphoreId_t)Sem));
+}
+
+cs43l22_os_queue_t cs43l22_OS_QueueCreate(uint32_t Count, uint32_t MsgSize)
+{
+  return osMessageQueueNew(Count, MsgSize, NULL);
+}
+
+cs43l22_OSStatusTypeDef cs43l22_OS_QueuePut(cs43l22_os_queue_t Queue, const void *pMsg, uint32_t Timeout)
+{
+  return OS_Status(osMessageQueuePut((osMessageQueueId_t)Queue, pMsg, 0U, OS_Ticks(Timeout)));
+}
+
+cs43l22_OSStatusTypeDef cs43l22_OS_QueueGet(cs43l22_os_queue_t Queue, void *pMsg, uint32_t Timeout)
+{
+  return OS_Status(osMessageQueueGet((osMessageQueueId_t)Queue, pMsg, NULL, OS_Ticks(Timeout)));
+}
+
+cs43l22_os_thread_t cs43l22_OS_ThreadCreate(const char *Name, void (*Func)(void *), void *Arg,
+                                            uint32_t StackSize, uint8_t Prio)
+{
+  osThreadAttr_t attr = {0};
+
+  attr.name = Name;
+  attr.stack_size = StackSize;
+  attr.priority = (Prio == CS43L22_OS_PRIO_HIGH)? osPriorityHigh : osPriorityNormal;
+
+  return osThreadNew(Func, Arg, &attr);
+}
+
+cs43l22_os_thread_t cs43l22_OS_ThreadSelf(void)
+{
+  return osThreadGetId();
+}
+
+uint8_t cs43l22_OS_InISR(void)
+{
+  return (__get_IPSR() != 0U)? 1 : 0;
+}
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+#endif /* CS43L22_OS_CMSIS2 */
@@ -0,0 +1,293 @@
+/**
+  ******************************************************************************
+  * @file    cs43l22_os_posix.c
+  * @brief   POSIX (pthreads) port of the CS43L22 operating system abstraction,
+  *          used to run the driver and its audio task on a host.
+  * @note    Thread priorities are not applied: real-time scheduling needs
+  *          privileges a host test normally does not have.
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include "cs43l22_os.h"
+
+#if defined(CS43L22_OS_POSIX)
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/** @addtogroup CS43L22
+  * @{
+  */
+
+/** @defgroup CS43L22_OS_POSIX_Private_Types
+  * @{
+  */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t count;
+  uint32_t max;
+} OS_SemTypeDef;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;      /* Signalled when a message is added */
+  pthread_cond_t room;      /* Signalled when a message is removed */
+  uint8_t *buffer;
+  uint32_t msgSize;
+  uint32_t size;
+  uint32_t head;
+  uint32_t count;
+  uint32_t space;           /* size - count */
+} OS_QueueTypeDef;
+
+typedef struct {
+  pthread_t id;
+  void (*func)(void *);
+  void *arg;
+} OS_ThreadTypeDef;
+
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_OS_POSIX_Private_Variables
+  * @{
+  */
+static _Thread_local OS_ThreadTypeDef *os_self;
+
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_OS_POSIX_Private_Functions
+  * @{
+  */
+
+/* Waits on Cond until Ready is set or the timeout expires, Lock held */
+static cs43l22_OSStatusTypeDef OS_Wait(pthread_cond_t *Cond, pthread_mutex_t *Lock,
+                                       const uint32_t *Ready, uint32_t Timeout)
+{
+  struct timespec deadline;
+
+  if (Timeout == CS43L22_OS_WAIT_FOREVER)
+  {
+    while (*Ready == 0) pthread_cond_wait(Cond, Lock);
+    return CS43L22_OS_OK;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += Timeout / 1000U;
+  deadline.tv_nsec += (long)(Timeout % 1000U) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  while (*Ready == 0)
+  {
+    if (pthread_cond_timedwait(Cond, Lock, &deadline) == ETIMEDOUT)
+    {
+      return (*Ready == 0)? CS43L22_OS_TIMEOUT : CS43L22_OS_OK;
+    }
+  }
+  return CS43L22_OS_OK;
+}
+
+static void *OS_ThreadEntry(void *Arg)
+{
+  os_self = (OS_ThreadTypeDef *)Arg;
+  os_self->func(os_self->arg);
+  return NULL;
+}
+
+cs43l22_os_mutex_t cs43l22_OS_MutexCreate(void)
+{
+  pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+
+  if ((mutex != NULL) && (pthread_mutex_init(mutex, NULL) != 0))
+  {
+    free(mutex);
+    mutex = NULL;
+  }
+  return mutex;
+}
+
+cs43l22_OSStatusTypeDef cs43l22_OS_MutexLock(cs43l22_os_mutex_t Mutex, uint32_t Timeout)
+{
+  struct timespec deadline;
+
+  if (Timeout == CS43L22_OS_WAIT_FOREVER)
+  {
+    return (pthread_mutex_lock(Mutex) == 0)? CS43L22_OS_OK : CS43L22_OS_ERROR;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += Timeout / 1000U;
+  deadline.tv_nsec += (long)(Timeout % 1000U) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  switch (pthread_mutex_timedlock(Mutex, &deadline))
+  {
+  case 0:
+    return CS43L22_OS_OK;
+  case ETIMEDOUT:
+    return CS43L22_OS_TIMEOUT;
+  default:
+    return CS43L22_OS_ERROR;
+  }
+}
+
+cs43l22_OSStatusTypeDef cs43l22_OS_MutexUnlock(cs43l22_os_mutex_t Mutex)
+{
+  return (pthread_mutex_unlock(Mutex) == 0)? CS43L22_OS_OK : CS43L22_OS_ERROR;
+}
+
+cs43l22_os_sem_t cs43l22_OS_SemCreate(uint32_t MaxCount, uint32_t InitCount)
+{
+  OS_SemTypeDef *sem = calloc(1, sizeof(OS_SemTypeDef));
+
+  if (sem == NULL) return NULL;
+  pthread_mutex_init(&sem->lock, NULL);
+  pthread_cond_init(&sem->cond, NULL);
+  sem->count = InitCount;
+  sem->max = MaxCount;
+  return sem;
+}
+
+cs43l22_OSStatusTypeDef cs43l22_OS_SemTake(cs43l22_os_sem_t Sem, uint32_t Timeout)
+{
+  OS_SemTypeDef *sem = Sem;
+  cs43l22_OSStatusTypeDef status;
+
+  pthread_mutex_lock(&sem->lock);
+  status = OS_Wait(&sem->cond, &sem->lock, &sem->count, Timeout);
+  if (status == CS43L22_OS_OK) sem->count--;
+  pthread_mutex_unlock(&sem->lock);
+  return status;
+}
+
+cs43l22_OSStatusTypeDef cs43l22_OS_SemGive(cs43l22_os_sem_t Sem)
+{
+  OS_SemTypeDef *sem = Sem;
+  cs43l22_OSStatusTypeDef status = CS43L22_OS_ERROR;
+
+  pthread_mutex_lock(&sem->lock);
+  if (sem->count < sem->max)
+  {
+    sem->count++;
+    pthread_cond_signal(&sem->cond);
+    status = CS43L22_OS_OK;
+  }
+  pthread_mutex_unlock(&sem->lock);
+  return status;
+}
+
+cs43l22_os_queue_t cs43l22_OS_QueueCreate(uint32_t Count, uint32_t MsgSize)
+{
+  OS_QueueTypeDef *queue = calloc(1, sizeof(OS_QueueTypeDef));
+
+  if (queue == NULL) return NULL;
+  queue->buffer = calloc(Count, MsgSize);
+  if (queue->buffer == NULL)
+  {
+    free(queue);
+    return NULL;
+  }
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->cond, NULL);
+  pthread_cond_init(&queue->room, NULL);
+  queue->msgSize = MsgSize;
+  queue->size = Count;
+  queue->space = Count;
+  return queue;
+}
+
+cs43l22_OSStatusTypeDef cs43l22_OS_QueuePut(cs43l22_os_queue_t Queue, const void *pMsg, uint32_t Timeout)
+{
+  OS_QueueTypeDef *queue = Queue;
+  cs43l22_OSStatusTypeDef status;
+  uint32_t slot;
+
+  pthread_mutex_lock(&queue->lock);
+  status = OS_Wait(&queue->room, &queue->lock, &queue->space, Timeout);
+  if (status == CS43L22_OS_OK)
+  {
+    slot = (queue->head + queue->count) % queue->size;
+    memcpy(&queue->buffer[slot * queue->msgSize], pMsg, queue->msgSize);
+    queue->count++;
+    queue->space--;
+    pthread_cond_signal(&queue->cond);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return status;
+}
+
+cs43l22_OSStatusTypeDef cs43l22_OS_QueueGet(cs43l22_os_queue_t Queue, void *pMsg, uint32_t Timeout)
+{
+  OS_QueueTypeDef *queue = Queue;
+  cs43l22_OSStatusTypeDef status;
+
+  pthread_mutex_lock(&queue->lock);
+  status = OS_Wait(&queue->cond, &queue->lock, &queue->count, Timeout);
+  if (status == CS43L22_OS_OK)
+  {
+    memcpy(pMsg, &queue->buffer[queue->head * queue->msgSize], queue->msgSize);
+    queue->head = (queue->head + 1) % queue->size;
+    queue->count--;
+    queue->space++;
+    pthread_cond_signal(&queue->room);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return status;
+}
+
+cs43l22_os_thread_t cs43l22_OS_ThreadCreate(const char *Name, void (*Func)(void *), void *Arg,
+                                            uint32_t StackSize, uint8_t Prio)
+{
+  OS_ThreadTypeDef *thread = calloc(1, sizeof(OS_ThreadTypeDef));
+
+  (void)Name;
+  (void)StackSize;
+  (void)Prio;
+
+  if (thread == NULL) return NULL;
+  thread->func = Func;
+  thread->arg = Arg;
+  if (pthread_create(&thread->id, NULL, OS_ThreadEntry, thread) != 0)
+  {
+    free(thread);
+    return NULL;
+  }
+  pthread_detach(thread->id);
+  return thread;
+}
+
+cs43l22_os_thread_t cs43l22_OS_ThreadSelf(void)
+{
+  return os_self;
+}
+
+uint8_t cs43l22_OS_InISR(void)
+{
+  return 0;
+}
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+#endif /* CS43L22_OS_POSIX */
@@ -0,0 +1,291 @@
+/**
+  ******************************************************************************
+  * @file    cs43l22_task.c
+  * @brief   Audio tasks of the CS43L22 driver (CS43L22_USE_OS).
+  *          Once cs43l22_TaskStart() returns, every cs43l22_xxx() call made
+  *          from another thread is queued to the control task and executed
+  *          there, so the codec state and the I2C bus only have one user.
+  *          DMA refills run in a separate, higher priority refill task that
+  *          never touches the I2C bus: a slow or failing control transfer
+  *          cannot delay a refill.
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include "cs43l22.h"
+
+#if CS43L22_USE_OS
+
+/** @addtogroup BSP
+  * @{
+  */
+
+/** @addtogroup Components
+  * @{
+  */
+
+/** @addtogroup CS43L22
+  * @{
+  */
+
+/** @defgroup CS43L22_Task_Private_Types
+  * @{
+  */
+typedef struct {
+  uint8_t cmd;
+  uint32_t arg0;
+  uint32_t arg1;
+  uint32_t arg2;
+  void *ptr;
+} cs43l22_MsgTypeDef;
+
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_Task_Function_Prototypes
+  * @{
+  */
+static void     CS43L22_Task(void *argument);
+static void     CS43L22_RefillTask(void *argument);
+static void     CS43L22_PostRouting(cs43l22_HandlerTypeDef *hcs43);
+static uint32_t CS43L22_Execute(cs43l22_HandlerTypeDef *hcs43, const cs43l22_MsgTypeDef *msg);
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_Task_Functions
+  * @{
+  */
+
+/**
+  * @brief Creates the OS objects and starts the control and refill tasks.
+  * @note  Must be called once, before the API is used from several threads.
+  *        hcs43->TxRefillCallback should be set beforehand.
+  * @retval HAL_OK if both tasks are running.
+  */
+HAL_StatusTypeDef cs43l22_TaskStart(cs43l22_HandlerTypeDef *hcs43)
+{
+  if (hcs43->task != NULL) return HAL_OK;
+
+  hcs43->apiMutex = cs43l22_OS_MutexCreate();
+  hcs43->routeMutex = cs43l22_OS_MutexCreate();
+  hcs43->cmdDone = cs43l22_OS_SemCreate(1, 0);
+  hcs43->queue = cs43l22_OS_QueueCreate(CS43L22_TASK_QUEUE_SIZE, sizeof(cs43l22_MsgTypeDef));
+  hcs43->refillQueue = cs43l22_OS_QueueCreate(CS43L22_TASK_QUEUE_SIZE, sizeof(cs43l22_MsgTypeDef));
+  if ((hcs43->apiMutex == NULL) || (hcs43->routeMutex == NULL) || (hcs43->cmdDone == NULL) ||
+      (hcs43->queue == NULL) || (hcs43->refillQueue == NULL)) return HAL_ERROR;
+
+  hcs43->refillTask = cs43l22_OS_ThreadCreate("cs43l22_tx", CS43L22_RefillTask, hcs43,
+                                              CS43L22_TASK_STACK_SIZE, CS43L22_OS_PRIO_HIGH);
+  if (hcs43->refillTask == NULL) return HAL_ERROR;
+
+  hcs43->task = cs43l22_OS_ThreadCreate("cs43l22", CS43L22_Task, hcs43,
+                                        CS43L22_TASK_STACK_SIZE, CS43L22_OS_PRIO_NORMAL);
+
+  return (hcs43->task != NULL)? HAL_OK : HAL_ERROR;
+}
+
+/**
+  * @brief To be called from HAL_I2S_TxHalfCpltCallback().
+  */
+void cs43l22_TxHalfCpltISR(cs43l22_HandlerTypeDef *hcs43)
+{
+  cs43l22_MsgTypeDef msg = { CS43L22_CMD_TX_HALF, 0, 0, 0, NULL };
+
+  if (hcs43->refillQueue == NULL) return;
+  if (cs43l22_OS_QueuePut(hcs43->refillQueue, &msg, 0) != CS43L22_OS_OK)
+  {
+    hcs43->missedRefills++;
+  }
+}
+
+/**
+  * @brief To be called from HAL_I2S_TxCpltCallback().
+  */
+void cs43l22_TxCpltISR(cs43l22_HandlerTypeDef *hcs43)
+{
+  cs43l22_MsgTypeDef msg = { CS43L22_CMD_TX_CPLT, 0, 0, 0, NULL };
+
+  if (hcs43->refillQueue == NULL) return;
+  if (cs43l22_OS_QueuePut(hcs43->refillQueue, &msg, 0) != CS43L22_OS_OK)
+  {
+    hcs43->missedRefills++;
+  }
+}
+
+/**
+  * @brief Tells whether a call has to be handed over to the control task.
+  * @retval 1 when the task is running and the caller is another thread.
+  */
+uint8_t cs43l22_IsRemote(cs43l22_HandlerTypeDef *hcs43)
+{
+  return ((hcs43->task != NULL) && (cs43l22_OS_ThreadSelf() != hcs43->task))? 1 : 0;
+}
+
+/**
+  * @brief Runs a command on the control task and waits for its result.
+  * @note  Callers are serialized on apiMutex, so at most one command is
+  *        pending. Not allowed from interrupt context (returns HAL_BUSY).
+  * @retval Value returned by the command.
+  */
+uint32_t cs43l22_Dispatch(cs43l22_HandlerTypeDef *hcs43, uint8_t Cmd, uint32_t Arg0, uint32_t Arg1, uint32_t Arg2, void *Ptr)
+{
+  cs43l22_MsgTypeDef msg = { Cmd, Arg0, Arg1, Arg2, Ptr };
+  uint32_t result = HAL_ERROR;
+
+  if (cs43l22_OS_InISR()) return HAL_BUSY;
+
+  if (cs43l22_OS_MutexLock(hcs43->apiMutex, CS43L22_OS_WAIT_FOREVER) != CS43L22_OS_OK) return HAL_ERROR;
+
+  if (cs43l22_OS_QueuePut(hcs43->queue, &msg, CS43L22_OS_WAIT_FOREVER) == CS43L22_OS_OK)
+  {
+    cs43l22_OS_SemTake(hcs43->cmdDone, CS43L22_OS_WAIT_FOREVER);
+    result = hcs43->cmdResult;
+  }
+
+  cs43l22_OS_MutexUnlock(hcs43->apiMutex);
+  return result;
+}
+
+/**
+  * @}
+  */
+
+/** @defgroup CS43L22_Task_Private_Functions
+  * @{
+  */
+
+/**
+  * @brief Control task body: runs the commands, the only I2C user.
+  */
+static void CS43L22_Task(void *argument)
+{
+  cs43l22_HandlerTypeDef *hcs43 = (cs43l22_HandlerTypeDef *)argument;
+  cs43l22_MsgTypeDef msg;
+
+  for (;;)
+  {
+    if (cs43l22_OS_QueueGet(hcs43->queue, &msg, CS43L22_OS_WAIT_FOREVER) != CS43L22_OS_OK) continue;
+
+    /* Posted by the refill task, nobody waits for it */
+    if (msg.cmd == CS43L22_CMD_TX_ROUTING)
+    {
+      cs43l22_Process(hcs43);
+      continue;
+    }
+
+    hcs43->cmdResult = CS43L22_Execute(hcs43, &msg);
+    cs43l22_OS_SemGive(hcs43->cmdDone);
+  }
+}
+
+/**
+  * @brief Refill task body: refills and routes the released DMA blocks.
+  * @note  Never waits on the control bus, codec mixer updates are posted
+  *        to the control task.
+  */
+static void CS43L22_RefillTask(void *argument)
+{
+  cs43l22_HandlerTypeDef *hcs43 = (cs43l22_HandlerTypeDef *)argument;
+  cs43l22_MsgTypeDef msg;
+  uint16_t *pBlock;
+  uint16_t half;
+
+  for (;;)
+  {
+    if (cs43l22_OS_QueueGet(hcs43->refillQueue, &msg, CS43L22_OS_WAIT_FOREVER) != CS43L22_OS_OK) continue;
+
+    switch (msg.cmd)
+    {
+    case CS43L22_CMD_TX_HALF:
+    case CS43L22_CMD_TX_CPLT:
+      if (hcs43->txBuffer == NULL) break;
+
+      half = hcs43->txSize / 2;
+      pBlock = hcs43->txBuffer + ((msg.cmd == CS43L22_CMD_TX_CPLT)? half : 0);
+
+      cs43l22_TxBlock(hcs43, pBlock, half);
+      CS43L22_PostRouting(hcs43);
+      break;
+
+    default:
+      break;
+    }
+  }
+}
+
+/**
+  * @brief Hands a codec mixer update latched at a block boundary over to
+  *        the control task, without waiting (refill task).
+  * @note  When the control queue is full the update stays latched and is
+  *        posted again at the next boundary.
+  */
+static void CS43L22_PostRouting(cs43l22_HandlerTypeDef *hcs43)
+{
+  cs43l22_MsgTypeDef msg = { CS43L22_CMD_TX_ROUTING, 0, 0, 0, NULL };
+
+  if (hcs43->routeHwReady) cs43l22_OS_QueuePut(hcs43->queue, &msg, 0);
+}
+
+/**
+  * @brief Runs a queued command in the control task context.
+  */
+static uint32_t CS43L22_Execute(cs43l22_HandlerTypeDef *hcs43, const cs43l22_MsgTypeDef *msg)
+{
+  switch (msg->cmd)
+  {
+  case CS43L22_CMD_INIT:
+    return cs43l22_Init(hcs43, (uint16_t)msg->arg0, (uint8_t)msg->arg1, msg->arg2);
+  case CS43L22_CMD_DEINIT:
+    return cs43l22_DeInit(hcs43);
+  case CS43L22_CMD_READ_ID:
+    return cs43l22_ReadID(hcs43);
+  case CS43L22_CMD_STREAM_SOUND:
+    return cs43l22_StreamSound(hcs43, (uint16_t *)msg->ptr, (uint16_t)msg->arg0);
+  case CS43L22_CMD_PLAY:
+    return cs43l22_Play(hcs43);
+  case CS43L22_CMD_PAUSE:
+    return cs43l22_Pause(hcs43);
+  case CS43L22_CMD_RESUME:
+    return cs43l22_Resume(hcs43);
+  case CS43L22_CMD_STOP:
+    return cs43l22_Stop(hcs43, msg->arg0);
+  case CS43L22_CMD_SET_VOLUME:
+    return cs43l22_SetVolume(hcs43, (uint8_t)msg->arg0);
+  case CS43L22_CMD_SET_FREQUENCY:
+    return cs43l22_SetFrequency(hcs43, msg->arg0);
+  case CS43L22_CMD_SET_MUTE:
+    return cs43l22_SetMute(hcs43, (uint8_t)msg->arg0);
+  case CS43L22_CMD_SET_OUTPUT_MODE:
+    return cs43l22_SetOutputMode(hcs43, (uint8_t)msg->arg0);
+  case CS43L22_CMD_RESET:
+    return cs43l22_Reset(hcs43);
+  case CS43L22_CMD_RECOVER:
+    return cs43l22_Recover(hcs43);
+  case CS43L22_CMD_SET_ROUTING:
+    return cs43l22_SetRouting(hcs43, (const cs43l22_RoutingTypeDef *)msg->ptr);
+  case CS43L22_CMD_PROCESS:
+    return cs43l22_Process(hcs43);
+  default:
+    return HAL_ERROR;
+  }
+}
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+#endif /* CS43L22_USE_OS */
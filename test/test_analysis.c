@@ -0,0 +1,319 @@
+/**
+  ******************************************************************************
+  * @file    test_analysis.c
+  * @brief   Host test of the CS43L22 analysis tap: level math, Hann window,
+  *          anti-alias filter, radix-4 FFT, cycle budget and result
+  *          publication.
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cs43l22.h"
+
+/* Private defines -----------------------------------------------------------*/
+#define FRAMES_PER_FFT          (CS43L22_FFT_SIZE * CS43L22_FFT_DECIMATION)
+#define BLOCK_FRAMES            (FRAMES_PER_FFT / 4)
+#define PI                      3.14159265358979323846
+
+#define CHECK(cond)                                                           \
+  do {                                                                        \
+    if (!(cond))                                                              \
+    {                                                                         \
+      printf("%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+      failures++;                                                             \
+    }                                                                         \
+  } while (0)
+
+/* Within Tol (relative) of Expected */
+#define CHECK_NEAR(value, expected, tol)                                      \
+  CHECK(fabs((double)(value) - (double)(expected)) <= (tol) * (double)(expected))
+
+/* Private variables ---------------------------------------------------------*/
+static int failures;
+static uint32_t host_cycles;
+static uint32_t host_cycleStep;
+
+static cs43l22_AnalysisTypeDef hana;
+static cs43l22_AnalysisResultTypeDef result;
+static uint16_t block[2 * BLOCK_FRAMES];
+
+/* Host cycle counter: advances by host_cycleStep on each read */
+uint32_t HOST_GetCycles(void)
+{
+  host_cycles += host_cycleStep;
+  return host_cycles;
+}
+
+/* Helpers -------------------------------------------------------------------*/
+
+/* Gain of the 2nd order CIC on a sine at FFT bin Bin held over each
+   decimation group: triangular weights split between two groups */
+static double HeldGain(uint32_t Bin)
+{
+  const double r = CS43L22_FFT_DECIMATION;
+  double theta = 2 * PI * Bin / CS43L22_FFT_SIZE;
+  double re = r * (r + 1) / 2 + r * (r - 1) / 2 * cos(theta);
+  double im = r * (r - 1) / 2 * sin(theta);
+
+  return sqrt(re * re + im * im) / (r * r);
+}
+
+/* Sends one FFT frame of a sine of Cycles periods per input frame */
+static void FeedTone(double Cycles, int16_t Amplitude)
+{
+  uint32_t frame, i;
+  int16_t value;
+
+  for (frame = 0; frame < FRAMES_PER_FFT; frame += BLOCK_FRAMES)
+  {
+    for (i = 0; i < BLOCK_FRAMES; i++)
+    {
+      value = (int16_t)lround(Amplitude * sin(2 * PI * Cycles * (frame + i)));
+      block[2 * i] = (uint16_t)value;
+      block[2 * i + 1] = (uint16_t)value;
+    }
+    cs43l22_Analysis_Process(&hana, block, sizeof(block) / sizeof(block[0]));
+  }
+}
+
+/* Sends one FFT frame of a sine at FFT bin Bin, held over each decimation
+   group so the decimated feed is an exact sampled sine. */
+static void FeedSine(uint32_t Bin, int16_t Amplitude)
+{
+  uint32_t frame, i, n;
+  int16_t value;
+
+  for (frame = 0; frame < FRAMES_PER_FFT; frame += BLOCK_FRAMES)
+  {
+    for (i = 0; i < BLOCK_FRAMES; i++)
+    {
+      n = (frame + i) / CS43L22_FFT_DECIMATION;
+      value = (int16_t)lround(Amplitude * sin(2 * PI * Bin * n / CS43L22_FFT_SIZE));
+      block[2 * i] = (uint16_t)value;
+      block[2 * i + 1] = (uint16_t)value;
+    }
+    cs43l22_Analysis_Process(&hana, block, sizeof(block) / sizeof(block[0]));
+  }
+}
+
+static void FeedConstant(int16_t Left, int16_t Right, uint32_t Blocks)
+{
+  uint32_t i;
+
+  for (i = 0; i < BLOCK_FRAMES; i++)
+  {
+    block[2 * i] = (uint16_t)Left;
+    block[2 * i + 1] = (uint16_t)Right;
+  }
+  while (Blocks-- != 0) cs43l22_Analysis_Process(&hana, block, sizeof(block) / sizeof(block[0]));
+}
+
+/* Tests ---------------------------------------------------------------------*/
+static void Test_Levels(void)
+{
+  uint32_t i;
+
+  cs43l22_Analysis_Init(&hana, 0);
+
+  /* Square wave on L, silence on R */
+  for (i = 0; i < BLOCK_FRAMES; i++)
+  {
+    block[2 * i] = (uint16_t)(int16_t)((i & 1)? -16384 : 16384);
+    block[2 * i + 1] = 0;
+  }
+  cs43l22_Analysis_Process(&hana, block, sizeof(block) / sizeof(block[0]));
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.rms[0] == 16384);
+  CHECK(result.peak[0] == 16384);
+  CHECK(result.rms[1] == 0);
+  CHECK(result.peak[1] == 0);
+
+  /* Full scale negative peak */
+  FeedConstant(-32768, 1000, 1);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.peak[0] == 32768);
+  CHECK(result.rms[0] == 32768);
+  CHECK(result.rms[1] == 1000);
+
+  /* Sine: RMS is A / sqrt(2) */
+  for (i = 0; i < BLOCK_FRAMES; i++)
+  {
+    block[2 * i] = (uint16_t)(int16_t)lround(20000 * sin(2 * PI * i / 32));
+    block[2 * i + 1] = block[2 * i];
+  }
+  cs43l22_Analysis_Process(&hana, block, sizeof(block) / sizeof(block[0]));
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK_NEAR(result.rms[0], 20000 / sqrt(2), 0.001);
+  CHECK(result.peak[0] == 20000);
+}
+
+static void Test_SineSpectrum(void)
+{
+  const int16_t amplitude = 16000;
+  const uint32_t bin = CS43L22_FFT_SIZE / 8;
+  double peak = amplitude * HeldGain(bin);
+  uint32_t n;
+
+  cs43l22_Analysis_Init(&hana, 0);
+  FeedSine(bin, amplitude);
+
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.spectrumCount == 1);
+
+  /* Hann window: A/4 at the bin, A/8 on both neighbours (X[k] / N), A
+     scaled by the anti-alias filter. The tolerance covers the magnitude
+     estimate. */
+  CHECK_NEAR(result.spectrum[bin], peak / 4, 0.08);
+  CHECK_NEAR(result.spectrum[bin - 1], peak / 8, 0.10);
+  CHECK_NEAR(result.spectrum[bin + 1], peak / 8, 0.10);
+
+  /* Nothing else above the Q15 rounding floor */
+  for (n = 0; n < CS43L22_FFT_SIZE / 2; n++)
+  {
+    if ((n + 1 < bin) || (n > bin + 1)) CHECK(result.spectrum[n] <= 8);
+  }
+}
+
+static void Test_Alias(void)
+{
+  const int16_t amplitude = 16000;
+  const uint32_t bin = CS43L22_FFT_SIZE / 8;
+  uint16_t inBand;
+
+  /* In band tone at the bin */
+  cs43l22_Analysis_Init(&hana, 0);
+  FeedTone((double)bin / FRAMES_PER_FFT, amplitude);
+  FeedTone((double)bin / FRAMES_PER_FFT, amplitude);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  inBand = result.spectrum[bin];
+  CHECK(inBand > amplitude / 8);
+
+  /* Its image above the decimated Nyquist folds onto the same bin: a plain
+     average would pass it at -16 dB, the filter keeps it below -30 dB */
+  cs43l22_Analysis_Init(&hana, 0);
+  FeedTone((double)(CS43L22_FFT_SIZE - bin) / FRAMES_PER_FFT, amplitude);
+  FeedTone((double)(CS43L22_FFT_SIZE - bin) / FRAMES_PER_FFT, amplitude);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.spectrumCount == 2);
+  CHECK(result.spectrum[bin] < inBand / 30);
+}
+
+static void Test_DcSpectrum(void)
+{
+  uint32_t n;
+
+  cs43l22_Analysis_Init(&hana, 0);
+  FeedConstant(8000, 8000, 4);
+
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.spectrumCount == 1);
+
+  /* The window gain is 1/2 at DC, 1/4 on bin 1 */
+  CHECK_NEAR(result.spectrum[0], 4000, 0.02);
+  CHECK_NEAR(result.spectrum[1], 2000, 0.02);
+  for (n = 2; n < CS43L22_FFT_SIZE / 2; n++) CHECK(result.spectrum[n] <= 8);
+
+  /* L and R cancel in the mono feed */
+  cs43l22_Analysis_Init(&hana, 0);
+  FeedConstant(8000, -8000, 4);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.spectrum[0] == 0);
+}
+
+static void Test_Budget(void)
+{
+  host_cycleStep = 100;
+
+  /* The frame completes in the 4th block but the FFT no longer fits its
+     budget: it runs first in the next block */
+  cs43l22_Analysis_Init(&hana, 50);
+  FeedConstant(8000, 8000, 4);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.spectrumCount == 0);
+  CHECK(result.overruns == 4);
+
+  FeedConstant(8000, 8000, 1);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.spectrumCount == 1);
+  CHECK(result.spectrum[0] != 0);
+  CHECK(result.overruns == 5);
+  CHECK(result.maxCycles >= result.cycles);
+  CHECK(result.droppedFrames == 0);
+
+  /* The FFT is now known not to fit the budget at all: the next frame
+     is dropped, the spectrum stays the last one computed */
+  FeedConstant(8000, 8000, 3);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.spectrumCount == 1);
+  CHECK(result.droppedFrames == 0);
+
+  FeedConstant(8000, 8000, 1);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.spectrumCount == 1);
+  CHECK(result.droppedFrames == 1);
+  CHECK(result.spectrum[0] != 0);
+
+  /* A budget that fits the FFT but not the block and the FFT: deferred,
+     never dropped */
+  cs43l22_Analysis_Init(&hana, 150);
+  FeedConstant(8000, 8000, 8);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.spectrumCount == 1);
+  FeedConstant(8000, 8000, 1);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.spectrumCount == 2);
+  CHECK(result.droppedFrames == 0);
+
+  /* No budget: never deferred, never an overrun */
+  cs43l22_Analysis_Init(&hana, 0);
+  FeedConstant(8000, 8000, 4);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.spectrumCount == 1);
+  CHECK(result.overruns == 0);
+  CHECK(result.droppedFrames == 0);
+
+  host_cycleStep = 0;
+}
+
+static void Test_Publication(void)
+{
+  uint32_t i;
+
+  cs43l22_Analysis_Init(&hana, 0);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.sequence == 0);
+
+  for (i = 1; i <= 5; i++)
+  {
+    FeedConstant((int16_t)(1000 * i), 0, 1);
+    CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+    CHECK(result.sequence == i);
+    CHECK(result.peak[0] == 1000 * i);
+  }
+
+  /* Odd-sized and empty blocks */
+  cs43l22_Analysis_Process(&hana, block, 3);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.sequence == 6);
+  cs43l22_Analysis_Process(&hana, block, 0);
+  CHECK(cs43l22_Analysis_Read(&hana, &result) == HAL_OK);
+  CHECK(result.sequence == 7);
+  CHECK(result.rms[0] == 0);
+}
+
+int main(void)
+{
+  Test_Levels();
+  Test_SineSpectrum();
+  Test_Alias();
+  Test_DcSpectrum();
+  Test_Budget();
+  Test_Publication();
+
+  printf("test_analysis: %s\n", (failures == 0)? "PASS" : "FAIL");
+  return (failures == 0)? 0 : 1;
+}
@@ -0,0 +1,301 @@
+/**
+  ******************************************************************************
+  * @file    test_io_recovery.c
+  * @brief   Host test of the CS43L22 control path retries, bus recovery and
+  *          register re-sync, against a simulated I2C backend plugged in
+  *          through the AUDIO_IO_Write()/AUDIO_IO_Read() hooks.
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+
+#include "cs43l22.h"
+
+/* Private defines -----------------------------------------------------------*/
+#define SIM_INIT_TIME           5       /* Ticks taken by HAL_I2C_Init() */
+
+#define CHECK(cond)                                                           \
+  do {                                                                        \
+    if (!(cond))                                                              \
+    {                                                                         \
+      printf("%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+      failures++;                                                             \
+    }                                                                         \
+  } while (0)
+
+/* Private variables ---------------------------------------------------------*/
+static int failures;
+
+/* Simulated codec and bus */
+static uint8_t sim_reg[256];
+static uint32_t sim_tick;
+static uint32_t sim_nack;               /* Transactions left to NACK */
+static uint8_t sim_dead;                /* NACK every transaction */
+static GPIO_PinState sim_sda = GPIO_PIN_SET;
+static uint32_t sim_initTime = SIM_INIT_TIME;
+static uint32_t sim_transfers;
+static uint32_t sim_inits;
+
+static GPIO_TypeDef sim_port;
+static I2C_HandleTypeDef hi2c;
+static I2S_HandleTypeDef hi2s;
+static cs43l22_HandlerTypeDef hcs43;
+
+/* Simulated backend ---------------------------------------------------------*/
+static HAL_StatusTypeDef SIM_Transaction(void)
+{
+  sim_tick++;
+  sim_transfers++;
+  if (sim_dead) return HAL_ERROR;
+  if (sim_nack != 0)
+  {
+    sim_nack--;
+    return HAL_ERROR;
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef AUDIO_IO_Write(cs43l22_HandlerTypeDef *h, uint8_t Reg, uint8_t Value)
+{
+  (void)h;
+  if (SIM_Transaction() != HAL_OK) return HAL_ERROR;
+  sim_reg[Reg] = Value;
+  return HAL_OK;
+}
+
+uint8_t AUDIO_IO_Read(cs43l22_HandlerTypeDef *h, uint8_t Reg)
+{
+  if (SIM_Transaction() != HAL_OK)
+  {
+    h->ioReadStatus = HAL_ERROR;
+    return 0;
+  }
+  return sim_reg[Reg];
+}
+
+/* HAL stubs -----------------------------------------------------------------*/
+HAL_StatusTypeDef HAL_I2C_Init(I2C_HandleTypeDef *h) { (void)h; sim_inits++; sim_tick += sim_initTime; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2C_DeInit(I2C_HandleTypeDef *h) { (void)h; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2C_IsDeviceReady(I2C_HandleTypeDef *h, uint16_t a, uint32_t t, uint32_t to) { (void)h; (void)a; (void)t; (void)to; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2C_Mem_Write(I2C_HandleTypeDef *h, uint16_t a, uint16_t r, uint16_t s, uint8_t *p, uint16_t n, uint32_t to) { (void)h; (void)a; (void)r; (void)s; (void)p; (void)n; (void)to; return HAL_ERROR; }
+HAL_StatusTypeDef HAL_I2C_Mem_Read(I2C_HandleTypeDef *h, uint16_t a, uint16_t r, uint16_t s, uint8_t *p, uint16_t n, uint32_t to) { (void)h; (void)a; (void)r; (void)s; (void)p; (void)n; (void)to; return HAL_ERROR; }
+HAL_StatusTypeDef HAL_I2S_Transmit_DMA(I2S_HandleTypeDef *h, uint16_t *p, uint16_t n) { (void)h; (void)p; (void)n; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2S_DMAPause(I2S_HandleTypeDef *h) { (void)h; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2S_DMAResume(I2S_HandleTypeDef *h) { (void)h; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2S_DMAStop(I2S_HandleTypeDef *h) { (void)h; return HAL_OK; }
+void HAL_GPIO_Init(GPIO_TypeDef *p, GPIO_InitTypeDef *i) { (void)p; (void)i; }
+void HAL_GPIO_WritePin(GPIO_TypeDef *p, uint16_t n, GPIO_PinState s) { (void)p; (void)n; (void)s; }
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *p, uint16_t n) { (void)p; (void)n; return sim_sda; }
+uint32_t HAL_GetTick(void) { return sim_tick; }
+void HAL_Delay(uint32_t Delay) { sim_tick += Delay; }
+uint32_t __get_PRIMASK(void) { return 0; }
+void __set_PRIMASK(uint32_t m) { (void)m; }
+void __disable_irq(void) { }
+
+/* Helpers -------------------------------------------------------------------*/
+static void Setup(void)
+{
+  memset(sim_reg, 0, sizeof(sim_reg));
+  sim_nack = 0;
+  sim_dead = 0;
+  sim_sda = GPIO_PIN_SET;
+  sim_initTime = SIM_INIT_TIME;
+  sim_transfers = 0;
+  sim_inits = 0;
+
+  memset(&hcs43, 0, sizeof(hcs43));
+  hcs43.deviceAddr = 0x94;
+  hcs43.hi2c = &hi2c;
+  hcs43.hi2s = &hi2s;
+}
+
+/* Every register of the image matches the simulated codec */
+static int ImageMatches(void)
+{
+  uint8_t reg;
+
+  for (reg = 0; reg < CS43L22_REG_CACHE_SIZE; reg++)
+  {
+    if ((hcs43.regValid & ((uint64_t)1 << reg)) && (sim_reg[reg] != hcs43.regCache[reg])) return 0;
+  }
+  return 1;
+}
+
+/* Tests ---------------------------------------------------------------------*/
+static void Test_NackThenSucceed(void)
+{
+  uint32_t tickstart;
+
+  Setup();
+  sim_nack = 2;
+  tickstart = sim_tick;
+
+  CHECK(cs43l22_Init(&hcs43, OUTPUT_DEVICE_SPEAKER, 70, AUDIO_FREQUENCY_48K) == HAL_OK);
+  CHECK(hcs43.ioStats.retries == 2);
+  CHECK(hcs43.ioStats.recoveries == 0);
+  CHECK(hcs43.ioFault == 0);
+  CHECK(sim_reg[CS43L22_REG_POWER_CTL1] == 0x01);
+  CHECK(sim_reg[CS43L22_REG_POWER_CTL2] == 0xFA);
+  CHECK(sim_reg[CS43L22_REG_CLOCKING_CTL] == 0x81);
+  CHECK(sim_reg[CS43L22_REG_PLAYBACK_CTL2] == 0x06);
+  CHECK(hcs43.regValid & ((uint64_t)1 << CS43L22_REG_CH_MIXER_SWAP));
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x00);
+  CHECK(ImageMatches());
+
+  /* Backoff of 1 then 2 ticks before the third attempt */
+  CHECK(sim_tick - tickstart == sim_transfers + 1 + 2);
+
+  /* A NACKed read is retried too */
+  sim_reg[CS43L22_CHIPID_ADDR] = 0xE3;
+  sim_nack = 1;
+  CHECK(cs43l22_ReadID(&hcs43) == CS43L22_ID);
+  CHECK(hcs43.ioStats.retries == 3);
+}
+
+static void Test_PersistentFailure(void)
+{
+  uint32_t transfers;
+
+  Setup();
+  sim_dead = 1;
+
+  CHECK(cs43l22_Init(&hcs43, OUTPUT_DEVICE_SPEAKER, 70, AUDIO_FREQUENCY_48K) != HAL_OK);
+
+  /* One write and the first re-sync write run out of retries, the rest of
+     the sequence fails without touching the bus */
+  CHECK(sim_transfers == 2 * (CS43L22_I2C_RETRIES + 1));
+  CHECK(hcs43.ioStats.recoveries == 1);
+  CHECK(hcs43.ioStats.failures == 1);
+  CHECK(hcs43.ioFault == 1);
+
+  /* Still within the recovery interval: fail fast */
+  transfers = sim_transfers;
+  CHECK(cs43l22_SetVolume(&hcs43, 50) != HAL_OK);
+  CHECK(sim_transfers == transfers);
+  CHECK(hcs43.ioStats.recoveries == 1);
+
+  /* Still dead once the interval has elapsed: one more bounded attempt */
+  sim_tick += CS43L22_I2C_RECOVERY_INTERVAL;
+  CHECK(cs43l22_SetVolume(&hcs43, 50) != HAL_OK);
+  CHECK(sim_transfers == transfers + (CS43L22_I2C_RETRIES + 1));
+  CHECK(hcs43.ioStats.recoveries == 2);
+  CHECK(hcs43.ioFault == 1);
+
+  /* The codec comes back: the next rate-limited recovery writes the whole
+     image, including the registers that never reached the codec */
+  sim_dead = 0;
+  sim_tick += CS43L22_I2C_RECOVERY_INTERVAL;
+  CHECK(cs43l22_SetVolume(&hcs43, 80) == HAL_OK);
+  CHECK(hcs43.ioStats.recoveries == 3);
+  CHECK(hcs43.ioFault == 0);
+  CHECK(sim_reg[CS43L22_REG_CLOCKING_CTL] == 0x81);
+  CHECK(sim_reg[CS43L22_REG_TONE_CTL] == 0x0F);
+  CHECK(ImageMatches());
+
+  /* Explicit recovery is not rate-limited */
+  sim_dead = 1;
+  CHECK(cs43l22_SetMute(&hcs43, AUDIO_MUTE_ON) != HAL_OK);
+  CHECK(hcs43.ioFault == 1);
+  sim_dead = 0;
+  CHECK(cs43l22_Recover(&hcs43) == HAL_OK);
+  CHECK(hcs43.ioFault == 0);
+  CHECK(ImageMatches());
+
+  /* Nor is a new initialization */
+  sim_dead = 1;
+  CHECK(cs43l22_SetMute(&hcs43, AUDIO_MUTE_ON) != HAL_OK);
+  CHECK(hcs43.ioFault == 1);
+  sim_dead = 0;
+  CHECK(cs43l22_Init(&hcs43, OUTPUT_DEVICE_SPEAKER, 70, AUDIO_FREQUENCY_48K) == HAL_OK);
+  CHECK(hcs43.ioFault == 0);
+  CHECK(ImageMatches());
+}
+
+static void Test_Resync(void)
+{
+  uint8_t reg;
+
+  Setup();
+  CHECK(cs43l22_Init(&hcs43, OUTPUT_DEVICE_BOTH, 70, AUDIO_FREQUENCY_48K) == HAL_OK);
+  CHECK(cs43l22_Play(&hcs43) == HAL_OK);
+
+  /* The codec lost its configuration (brown-out): the first NACKed write
+     triggers the recovery, which writes everything back */
+  memset(sim_reg, 0, sizeof(sim_reg));
+  sim_nack = CS43L22_I2C_RETRIES + 1;
+  CHECK(cs43l22_SetVolume(&hcs43, 40) == HAL_OK);
+  CHECK(hcs43.ioStats.recoveries == 1);
+  CHECK(hcs43.ioStats.failures == 0);
+  CHECK(ImageMatches());
+
+  /* Nothing outside the image was written */
+  for (reg = 0; reg < CS43L22_REG_CACHE_SIZE; reg++)
+  {
+    if (!(hcs43.regValid & ((uint64_t)1 << reg))) CHECK(sim_reg[reg] == 0);
+  }
+
+  /* The power state is restored last */
+  CHECK(sim_reg[CS43L22_REG_POWER_CTL1] == 0x9E);
+}
+
+static void Test_RecoveryStats(void)
+{
+  uint32_t tickstart;
+  uint32_t first;
+
+  Setup();
+  CHECK(cs43l22_Init(&hcs43, OUTPUT_DEVICE_HEADPHONE, 70, AUDIO_FREQUENCY_48K) == HAL_OK);
+
+  tickstart = sim_tick;
+  CHECK(cs43l22_Recover(&hcs43) == HAL_OK);
+  first = hcs43.ioStats.lastRecoveryTime;
+  CHECK(first == sim_tick - tickstart);
+  CHECK(first >= SIM_INIT_TIME);
+  CHECK(hcs43.ioStats.maxRecoveryTime == first);
+
+  /* Slower recovery becomes the maximum */
+  sim_initTime = 100;
+  CHECK(cs43l22_Recover(&hcs43) == HAL_OK);
+  CHECK(hcs43.ioStats.lastRecoveryTime == first - SIM_INIT_TIME + 100);
+  CHECK(hcs43.ioStats.maxRecoveryTime == hcs43.ioStats.lastRecoveryTime);
+
+  /* Faster one only updates the last time */
+  sim_initTime = SIM_INIT_TIME;
+  CHECK(cs43l22_Recover(&hcs43) == HAL_OK);
+  CHECK(hcs43.ioStats.lastRecoveryTime == first);
+  CHECK(hcs43.ioStats.maxRecoveryTime == first - SIM_INIT_TIME + 100);
+  CHECK(hcs43.ioStats.recoveries == 3);
+  CHECK(hcs43.ioStats.failures == 0);
+}
+
+static void Test_BusStuck(void)
+{
+  Setup();
+  hcs43.sclPort = &sim_port;
+  hcs43.sclPin = 1 << 6;
+  hcs43.sdaPort = &sim_port;
+  hcs43.sdaPin = 1 << 9;
+
+  /* SDA held low: reported, but the peripheral is initialized again */
+  sim_sda = GPIO_PIN_RESET;
+  CHECK(AUDIO_IO_BusRecover(&hcs43) == HAL_ERROR);
+  CHECK(sim_inits == 1);
+
+  sim_sda = GPIO_PIN_SET;
+  CHECK(AUDIO_IO_BusRecover(&hcs43) == HAL_OK);
+  CHECK(sim_inits == 2);
+}
+
+int main(void)
+{
+  Test_NackThenSucceed();
+  Test_PersistentFailure();
+  Test_Resync();
+  Test_RecoveryStats();
+  Test_BusStuck();
+
+  printf("test_io_recovery: %s\n", (failures == 0)? "PASS" : "FAIL");
+  return (failures == 0)? 0 : 1;
+}
@@ -0,0 +1,381 @@
+/**
+  ******************************************************************************
+  * @file    test_routing.c
+  * @brief   Host test of the CS43L22 output routing without OS: block
+  *          boundaries driven through the DMA hooks, codec mixer updates
+  *          written by cs43l22_Process(), software downmix and the AUTO
+  *          engine across a bus fault.
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+
+#include "cs43l22.h"
+
+/* Private defines -----------------------------------------------------------*/
+#define BUFFER_SIZE             16      /* Samples in the DMA buffer */
+#define SAMPLE_L                1000
+#define SAMPLE_R                3000
+#define SAMPLE_ODD              777     /* Unpaired last sample of a block */
+
+#define CHECK(cond)                                                           \
+  do {                                                                        \
+    if (!(cond))                                                              \
+    {                                                                         \
+      printf("%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+      failures++;                                                             \
+    }                                                                         \
+  } while (0)
+
+/* Private variables ---------------------------------------------------------*/
+static int failures;
+
+/* Simulated codec and bus */
+static uint8_t sim_reg[256];
+static uint32_t sim_tick;
+static uint8_t sim_dead;                /* NACK every transaction */
+static uint32_t sim_transfers;
+static uint32_t sim_mixerWrites;
+static uint32_t sim_playbackWrites;
+
+/* Simulated interrupt masking and context */
+static uint32_t sim_primask;
+static uint32_t sim_irqOff;             /* __disable_irq() calls */
+static uint32_t sim_irqRestore;         /* __set_PRIMASK() calls */
+static uint32_t sim_irqOffIo;           /* Transactions with interrupts masked */
+static uint8_t sim_inIsr;
+static uint32_t sim_isrIo;              /* Transactions from the DMA hooks */
+
+static I2C_HandleTypeDef hi2c;
+static I2S_HandleTypeDef hi2s;
+static cs43l22_HandlerTypeDef hcs43;
+static uint16_t buffer[BUFFER_SIZE];
+
+/* Simulated backend ---------------------------------------------------------*/
+static HAL_StatusTypeDef SIM_Transaction(void)
+{
+  sim_tick++;
+  sim_transfers++;
+  if (sim_primask) sim_irqOffIo++;
+  if (sim_inIsr) sim_isrIo++;
+  return (sim_dead)? HAL_ERROR : HAL_OK;
+}
+
+HAL_StatusTypeDef AUDIO_IO_Write(cs43l22_HandlerTypeDef *h, uint8_t Reg, uint8_t Value)
+{
+  (void)h;
+  if (SIM_Transaction() != HAL_OK) return HAL_ERROR;
+  sim_reg[Reg] = Value;
+  if (Reg == CS43L22_REG_CH_MIXER_SWAP) sim_mixerWrites++;
+  if (Reg == CS43L22_REG_PLAYBACK_CTL2) sim_playbackWrites++;
+  return HAL_OK;
+}
+
+uint8_t AUDIO_IO_Read(cs43l22_HandlerTypeDef *h, uint8_t Reg)
+{
+  if (SIM_Transaction() != HAL_OK)
+  {
+    h->ioReadStatus = HAL_ERROR;
+    return 0;
+  }
+  return sim_reg[Reg];
+}
+
+/* HAL stubs -----------------------------------------------------------------*/
+HAL_StatusTypeDef HAL_I2C_Init(I2C_HandleTypeDef *h) { (void)h; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2C_DeInit(I2C_HandleTypeDef *h) { (void)h; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2C_IsDeviceReady(I2C_HandleTypeDef *h, uint16_t a, uint32_t t, uint32_t to) { (void)h; (void)a; (void)t; (void)to; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2C_Mem_Write(I2C_HandleTypeDef *h, uint16_t a, uint16_t r, uint16_t s, uint8_t *p, uint16_t n, uint32_t to) { (void)h; (void)a; (void)r; (void)s; (void)p; (void)n; (void)to; return HAL_ERROR; }
+HAL_StatusTypeDef HAL_I2C_Mem_Read(I2C_HandleTypeDef *h, uint16_t a, uint16_t r, uint16_t s, uint8_t *p, uint16_t n, uint32_t to) { (void)h; (void)a; (void)r; (void)s; (void)p; (void)n; (void)to; return HAL_ERROR; }
+HAL_StatusTypeDef HAL_I2S_Transmit_DMA(I2S_HandleTypeDef *h, uint16_t *p, uint16_t n) { (void)h; (void)p; (void)n; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2S_DMAPause(I2S_HandleTypeDef *h) { (void)h; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2S_DMAResume(I2S_HandleTypeDef *h) { (void)h; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2S_DMAStop(I2S_HandleTypeDef *h) { (void)h; return HAL_OK; }
+void HAL_GPIO_Init(GPIO_TypeDef *p, GPIO_InitTypeDef *i) { (void)p; (void)i; }
+void HAL_GPIO_WritePin(GPIO_TypeDef *p, uint16_t n, GPIO_PinState s) { (void)p; (void)n; (void)s; }
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *p, uint16_t n) { (void)p; (void)n; return GPIO_PIN_SET; }
+uint32_t HAL_GetTick(void) { return sim_tick; }
+void HAL_Delay(uint32_t Delay) { sim_tick += Delay; }
+uint32_t __get_PRIMASK(void) { return sim_primask; }
+void __set_PRIMASK(uint32_t m) { sim_primask = m; sim_irqRestore++; }
+void __disable_irq(void) { sim_primask = 1; sim_irqOff++; }
+
+/* Helpers -------------------------------------------------------------------*/
+
+/* Refill with L = SAMPLE_L, R = SAMPLE_R, SAMPLE_ODD in an unpaired slot */
+static void Refill(cs43l22_HandlerTypeDef *h, uint16_t *pBuffer, uint16_t Size)
+{
+  uint16_t i;
+
+  (void)h;
+  for (i = 0; i + 1 < Size; i += 2)
+  {
+    pBuffer[i] = SAMPLE_L;
+    pBuffer[i + 1] = SAMPLE_R;
+  }
+  if (Size & 1) pBuffer[Size - 1] = SAMPLE_ODD;
+}
+
+/* Every pair of pBuffer[0..Size) is (Left, Right) */
+static int BlockIs(const uint16_t *pBuffer, uint16_t Size, int16_t Left, int16_t Right)
+{
+  uint16_t i;
+
+  for (i = 0; i + 1 < Size; i += 2)
+  {
+    if (((int16_t)pBuffer[i] != Left) || ((int16_t)pBuffer[i + 1] != Right)) return 0;
+  }
+  return 1;
+}
+
+static HAL_StatusTypeDef Route(uint8_t ChannelMap, uint8_t SpeakerMono, uint8_t Engine)
+{
+  cs43l22_RoutingTypeDef routing;
+
+  routing.outputDevice = OUTPUT_DEVICE_BOTH;
+  routing.channelMap = ChannelMap;
+  routing.speakerMono = SpeakerMono;
+  routing.engine = Engine;
+  return cs43l22_SetRouting(&hcs43, &routing);
+}
+
+/* Calls the DMA hook of one half, as HAL_I2S_Tx(Half)CpltCallback() would */
+static void TxEvent(uint8_t Cplt)
+{
+  sim_inIsr = 1;
+  if (Cplt) cs43l22_TxCpltISR(&hcs43);
+  else cs43l22_TxHalfCpltISR(&hcs43);
+  sim_inIsr = 0;
+}
+
+static void Setup(uint8_t Refilled)
+{
+  memset(sim_reg, 0, sizeof(sim_reg));
+  sim_dead = 0;
+
+  memset(&hcs43, 0, sizeof(hcs43));
+  hcs43.deviceAddr = 0x94;
+  hcs43.hi2c = &hi2c;
+  hcs43.hi2s = &hi2s;
+  hcs43.TxRefillCallback = (Refilled)? Refill : NULL;
+
+  CHECK(cs43l22_Init(&hcs43, OUTPUT_DEVICE_BOTH, 70, AUDIO_FREQUENCY_48K) == HAL_OK);
+  sim_mixerWrites = 0;
+  sim_playbackWrites = 0;
+}
+
+static void StartStream(void)
+{
+  Refill(&hcs43, buffer, BUFFER_SIZE);
+  CHECK(cs43l22_StreamSound(&hcs43, buffer, BUFFER_SIZE) == HAL_OK);
+  CHECK(cs43l22_Play(&hcs43) == HAL_OK);
+  sim_mixerWrites = 0;
+  sim_playbackWrites = 0;
+}
+
+/* Tests ---------------------------------------------------------------------*/
+static void Test_Stopped(void)
+{
+  Setup(0);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x00);
+  CHECK(sim_reg[CS43L22_REG_PLAYBACK_CTL2] == 0x06);
+
+  /* No stream: written at once */
+  CHECK(Route(CS43L22_CHMAP_SWAP, 0, CS43L22_ROUTE_HW) == HAL_OK);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0xF0);
+  CHECK(sim_reg[CS43L22_REG_PLAYBACK_CTL2] == 0x00);
+  CHECK(sim_mixerWrites == 1);
+  CHECK(hcs43.hwChannelMap == CS43L22_CHMAP_SWAP);
+
+  /* Invalid, or software without a refill to apply it to */
+  CHECK(Route(CS43L22_CHMAP_RIGHT + 1, 0, CS43L22_ROUTE_HW) == HAL_ERROR);
+  CHECK(Route(CS43L22_CHMAP_MONO, 0, CS43L22_ROUTE_SW + 1) == HAL_ERROR);
+  CHECK(Route(CS43L22_CHMAP_MONO, 0, CS43L22_ROUTE_SW) == HAL_ERROR);
+  CHECK(sim_mixerWrites == 1);
+
+  /* AUTO keeps the codec mixer */
+  CHECK(Route(CS43L22_CHMAP_LEFT, 1, CS43L22_ROUTE_AUTO) == HAL_OK);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x30);
+  CHECK(sim_reg[CS43L22_REG_PLAYBACK_CTL2] == 0x06);
+
+  /* Software: stereo mixer, the stream buffer is downmixed before it is sent */
+  Setup(1);
+  CHECK(Route(CS43L22_CHMAP_RIGHT, 0, CS43L22_ROUTE_SW) == HAL_OK);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x00);
+  StartStream();
+  CHECK(BlockIs(buffer, BUFFER_SIZE, SAMPLE_R, SAMPLE_R));
+}
+
+static void Test_Boundaries(void)
+{
+  uint32_t transfers;
+
+  Setup(1);
+  StartStream();
+
+  /* Playing: nothing written by the call */
+  CHECK(Route(CS43L22_CHMAP_SWAP, 0, CS43L22_ROUTE_HW) == HAL_OK);
+  CHECK(sim_mixerWrites == 0);
+
+  /* First boundary: selected for the block refilled, not yet playing */
+  transfers = sim_transfers;
+  TxEvent(0);
+  CHECK(sim_transfers == transfers);
+  CHECK(cs43l22_Process(&hcs43) == HAL_OK);
+  CHECK(sim_mixerWrites == 0);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x00);
+  CHECK(BlockIs(buffer, BUFFER_SIZE / 2, SAMPLE_L, SAMPLE_R));
+
+  /* Second boundary: that block plays, cs43l22_Process() writes the mixer */
+  TxEvent(1);
+  CHECK(sim_transfers == transfers);
+  CHECK(sim_mixerWrites == 0);
+  CHECK(cs43l22_Process(&hcs43) == HAL_OK);
+  CHECK(sim_mixerWrites == 1);
+  CHECK(sim_playbackWrites == 1);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0xF0);
+  CHECK(sim_reg[CS43L22_REG_PLAYBACK_CTL2] == 0x00);
+
+  /* Written once */
+  TxEvent(0);
+  CHECK(cs43l22_Process(&hcs43) == HAL_OK);
+  CHECK(sim_mixerWrites == 1);
+
+  /* Software mono: each refilled block is downmixed from its boundary on,
+     the mixer goes back to stereo one boundary later */
+  CHECK(Route(CS43L22_CHMAP_MONO, 1, CS43L22_ROUTE_SW) == HAL_OK);
+  TxEvent(1);
+  CHECK(BlockIs(buffer + BUFFER_SIZE / 2, BUFFER_SIZE / 2, 2000, 2000));
+  CHECK(cs43l22_Process(&hcs43) == HAL_OK);
+  CHECK(sim_mixerWrites == 1);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0xF0);
+
+  TxEvent(0);
+  CHECK(BlockIs(buffer, BUFFER_SIZE / 2, 2000, 2000));
+  CHECK(cs43l22_Process(&hcs43) == HAL_OK);
+  CHECK(sim_mixerWrites == 2);
+  CHECK(sim_playbackWrites == 2);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x00);
+  CHECK(sim_reg[CS43L22_REG_PLAYBACK_CTL2] == 0x06);
+
+  /* The DMA hooks never touched the bus */
+  CHECK(sim_isrIo == 0);
+}
+
+static void Test_OddSize(void)
+{
+  uint16_t block[7];
+
+  Setup(1);
+  StartStream();
+
+  /* The unpaired last sample is left alone */
+  CHECK(Route(CS43L22_CHMAP_SWAP, 0, CS43L22_ROUTE_SW) == HAL_OK);
+  cs43l22_TxBlock(&hcs43, block, 7);
+  CHECK(BlockIs(block, 7, SAMPLE_R, SAMPLE_L));
+  CHECK(block[6] == SAMPLE_ODD);
+
+  CHECK(Route(CS43L22_CHMAP_MONO, 0, CS43L22_ROUTE_SW) == HAL_OK);
+  cs43l22_TxBlock(&hcs43, block, 7);
+  CHECK(BlockIs(block, 7, 2000, 2000));
+  CHECK(block[6] == SAMPLE_ODD);
+
+  CHECK(Route(CS43L22_CHMAP_LEFT, 0, CS43L22_ROUTE_SW) == HAL_OK);
+  cs43l22_TxBlock(&hcs43, block, 7);
+  CHECK(BlockIs(block, 7, SAMPLE_L, SAMPLE_L));
+  CHECK(block[6] == SAMPLE_ODD);
+
+  CHECK(Route(CS43L22_CHMAP_RIGHT, 0, CS43L22_ROUTE_SW) == HAL_OK);
+  cs43l22_TxBlock(&hcs43, block, 7);
+  CHECK(BlockIs(block, 7, SAMPLE_R, SAMPLE_R));
+  CHECK(block[6] == SAMPLE_ODD);
+
+  /* A single sample */
+  cs43l22_TxBlock(&hcs43, block, 1);
+  CHECK(block[0] == SAMPLE_ODD);
+}
+
+static void Test_AutoFault(void)
+{
+  Setup(1);
+  StartStream();
+
+  /* AUTO on a healthy bus: the codec swaps */
+  CHECK(Route(CS43L22_CHMAP_SWAP, 0, CS43L22_ROUTE_AUTO) == HAL_OK);
+  TxEvent(0);
+  TxEvent(1);
+  CHECK(cs43l22_Process(&hcs43) == HAL_OK);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0xF0);
+  CHECK(hcs43.routeEngine == CS43L22_ROUTE_HW);
+
+  /* The bus fails: the software engine takes over, but the codec still
+     swaps, so the blocks are not swapped a second time */
+  sim_dead = 1;
+  CHECK(cs43l22_SetVolume(&hcs43, 50) != HAL_OK);
+  CHECK(hcs43.ioFault == 1);
+  TxEvent(0);
+  CHECK(hcs43.routeEngine == CS43L22_ROUTE_SW);
+  CHECK(BlockIs(buffer, BUFFER_SIZE / 2, SAMPLE_L, SAMPLE_R));
+  TxEvent(1);
+  CHECK(cs43l22_Process(&hcs43) != HAL_OK);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0xF0);
+  CHECK(BlockIs(buffer + BUFFER_SIZE / 2, BUFFER_SIZE / 2, SAMPLE_L, SAMPLE_R));
+
+  /* A new channel map goes through the swapping codec */
+  CHECK(Route(CS43L22_CHMAP_LEFT, 0, CS43L22_ROUTE_AUTO) == HAL_OK);
+  TxEvent(0);
+  CHECK(BlockIs(buffer, BUFFER_SIZE / 2, SAMPLE_L, SAMPLE_L));
+
+  /* The codec is back: the re-sync writes the stereo mixer of the image,
+     the software map follows at the next boundary and AUTO returns to the
+     codec mixer one boundary later */
+  sim_dead = 0;
+  CHECK(cs43l22_Recover(&hcs43) == HAL_OK);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x00);
+  CHECK(hcs43.hwChannelMap == CS43L22_CHMAP_STEREO);
+  TxEvent(1);
+  CHECK(hcs43.routeEngine == CS43L22_ROUTE_HW);
+  CHECK(BlockIs(buffer + BUFFER_SIZE / 2, BUFFER_SIZE / 2, SAMPLE_L, SAMPLE_R));
+  TxEvent(0);
+  CHECK(cs43l22_Process(&hcs43) == HAL_OK);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x30);
+}
+
+static void Test_NoRefill(void)
+{
+  Setup(0);
+  StartStream();
+
+  /* The buffer replays as it is, only the codec mixer follows */
+  CHECK(Route(CS43L22_CHMAP_MONO, 0, CS43L22_ROUTE_HW) == HAL_OK);
+  TxEvent(0);
+  TxEvent(1);
+  CHECK(cs43l22_Process(&hcs43) == HAL_OK);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x50);
+  CHECK(BlockIs(buffer, BUFFER_SIZE, SAMPLE_L, SAMPLE_R));
+}
+
+static void Test_InterruptMask(void)
+{
+  /* Every critical section of the tests above restored the mask, and no
+     bus transaction ran with interrupts masked */
+  CHECK(sim_irqOff != 0);
+  CHECK(sim_irqOff == sim_irqRestore);
+  CHECK(sim_primask == 0);
+  CHECK(sim_irqOffIo == 0);
+}
+
+int main(void)
+{
+  Test_Stopped();
+  Test_Boundaries();
+  Test_OddSize();
+  Test_AutoFault();
+  Test_NoRefill();
+  Test_InterruptMask();
+
+  printf("test_routing: %s\n", (failures == 0)? "PASS" : "FAIL");
+  return (failures == 0)? 0 : 1;
+}
@@ -0,0 +1,409 @@
+/**
+  ******************************************************************************
+  * @file    test_task.c
+  * @brief   Host test of the CS43L22 audio tasks (CS43L22_USE_OS) on the
+  *          POSIX port: command dispatch from several threads, DMA refills,
+  *          routing handoff to the control task and the queue timeouts.
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cs43l22.h"
+
+/* Private defines -----------------------------------------------------------*/
+#define SIM_TRANSFER_TIME       50      /* us per bus transaction */
+#define BUFFER_SIZE             64      /* Samples in the DMA buffer */
+#define API_THREADS             4
+#define API_CALLS               20
+
+#define CHECK(cond)                                                           \
+  do {                                                                        \
+    if (!(cond))                                                              \
+    {                                                                         \
+      printf("%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+      failures++;                                                             \
+    }                                                                         \
+  } while (0)
+
+/* Polls Cond for up to one second */
+#define WAIT_FOR(cond)                                                        \
+  do {                                                                        \
+    int wait_;                                                                \
+    for (wait_ = 0; (wait_ < 1000) && !(cond); wait_++) usleep(1000);         \
+  } while (0)
+
+/* Private variables ---------------------------------------------------------*/
+static int failures;
+
+/* Simulated codec and bus */
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile uint8_t sim_reg[256];
+static uint32_t sim_busy;               /* Transactions in progress */
+static uint32_t sim_overlaps;           /* Transactions started while another one ran */
+static uint32_t sim_remote;             /* Transactions not run by the control task */
+static volatile uint8_t sim_hold;       /* Transactions wait while set */
+static volatile uint8_t sim_holding;    /* A transaction waits on sim_hold */
+
+/* Refills seen by TxRefillCallback */
+static volatile uint32_t refills;
+static volatile uint8_t refill_hold;    /* The callback waits while set */
+static volatile uint8_t refill_holding;
+static uint16_t *refill_block;
+static uint16_t refill_size;
+static uint8_t refill_inTask;           /* Last refill ran in the refill task */
+static uint8_t refill_remote;           /* cs43l22_IsRemote() seen by the last refill */
+
+static I2C_HandleTypeDef hi2c;
+static I2S_HandleTypeDef hi2s;
+static cs43l22_HandlerTypeDef hcs43;
+static uint16_t buffer[BUFFER_SIZE];
+
+/* Simulated backend ---------------------------------------------------------*/
+static void SIM_Transaction(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  if (sim_busy++ != 0) sim_overlaps++;
+  if (cs43l22_IsRemote(&hcs43)) sim_remote++;
+  pthread_mutex_unlock(&sim_lock);
+
+  while (sim_hold)
+  {
+    sim_holding = 1;
+    usleep(100);
+  }
+  sim_holding = 0;
+  usleep(SIM_TRANSFER_TIME);
+
+  pthread_mutex_lock(&sim_lock);
+  sim_busy--;
+  pthread_mutex_unlock(&sim_lock);
+}
+
+HAL_StatusTypeDef AUDIO_IO_Write(cs43l22_HandlerTypeDef *h, uint8_t Reg, uint8_t Value)
+{
+  (void)h;
+  SIM_Transaction();
+  sim_reg[Reg] = Value;
+  return HAL_OK;
+}
+
+uint8_t AUDIO_IO_Read(cs43l22_HandlerTypeDef *h, uint8_t Reg)
+{
+  (void)h;
+  SIM_Transaction();
+  return sim_reg[Reg];
+}
+
+/* HAL stubs -----------------------------------------------------------------*/
+HAL_StatusTypeDef HAL_I2C_Init(I2C_HandleTypeDef *h) { (void)h; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2C_DeInit(I2C_HandleTypeDef *h) { (void)h; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2C_IsDeviceReady(I2C_HandleTypeDef *h, uint16_t a, uint32_t t, uint32_t to) { (void)h; (void)a; (void)t; (void)to; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2C_Mem_Write(I2C_HandleTypeDef *h, uint16_t a, uint16_t r, uint16_t s, uint8_t *p, uint16_t n, uint32_t to) { (void)h; (void)a; (void)r; (void)s; (void)p; (void)n; (void)to; return HAL_ERROR; }
+HAL_StatusTypeDef HAL_I2C_Mem_Read(I2C_HandleTypeDef *h, uint16_t a, uint16_t r, uint16_t s, uint8_t *p, uint16_t n, uint32_t to) { (void)h; (void)a; (void)r; (void)s; (void)p; (void)n; (void)to; return HAL_ERROR; }
+HAL_StatusTypeDef HAL_I2S_Transmit_DMA(I2S_HandleTypeDef *h, uint16_t *p, uint16_t n) { (void)h; (void)p; (void)n; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2S_DMAPause(I2S_HandleTypeDef *h) { (void)h; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2S_DMAResume(I2S_HandleTypeDef *h) { (void)h; return HAL_OK; }
+HAL_StatusTypeDef HAL_I2S_DMAStop(I2S_HandleTypeDef *h) { (void)h; return HAL_OK; }
+void HAL_GPIO_Init(GPIO_TypeDef *p, GPIO_InitTypeDef *i) { (void)p; (void)i; }
+void HAL_GPIO_WritePin(GPIO_TypeDef *p, uint16_t n, GPIO_PinState s) { (void)p; (void)n; (void)s; }
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *p, uint16_t n) { (void)p; (void)n; return GPIO_PIN_SET; }
+
+uint32_t HAL_GetTick(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+void HAL_Delay(uint32_t Delay) { usleep(Delay * 1000); }
+
+/* Helpers -------------------------------------------------------------------*/
+
+/* Refill with L = 1000, R = 3000 */
+static void Refill(cs43l22_HandlerTypeDef *h, uint16_t *pBuffer, uint16_t Size)
+{
+  uint16_t i;
+
+  refill_block = pBuffer;
+  refill_size = Size;
+  refill_inTask = (cs43l22_OS_ThreadSelf() == h->refillTask)? 1 : 0;
+  refill_remote = cs43l22_IsRemote(h);
+
+  for (i = 0; i + 1 < Size; i += 2)
+  {
+    pBuffer[i] = 1000;
+    pBuffer[i + 1] = 3000;
+  }
+
+  while (refill_hold)
+  {
+    refill_holding = 1;
+    usleep(100);
+  }
+  refill_holding = 0;
+
+  refills++;
+}
+
+/* Every register of the image matches the simulated codec */
+static int ImageMatches(void)
+{
+  uint8_t reg;
+
+  for (reg = 0; reg < CS43L22_REG_CACHE_SIZE; reg++)
+  {
+    if ((hcs43.regValid & ((uint64_t)1 << reg)) && (sim_reg[reg] != hcs43.regCache[reg])) return 0;
+  }
+  return 1;
+}
+
+/* Posts one DMA event and waits for its refill */
+static void TxEvent(uint8_t Cplt)
+{
+  uint32_t count = refills;
+
+  if (Cplt) cs43l22_TxCpltISR(&hcs43);
+  else cs43l22_TxHalfCpltISR(&hcs43);
+  WAIT_FOR(refills != count);
+}
+
+static void *ApiThread(void *Arg)
+{
+  uint32_t id = (uint32_t)(uintptr_t)Arg;
+  uint32_t i;
+  uint32_t errors = 0;
+
+  for (i = 0; i < API_CALLS; i++)
+  {
+    errors += cs43l22_SetVolume(&hcs43, (uint8_t)(10 * id + i));
+    errors += cs43l22_SetMute(&hcs43, (i & 1)? AUDIO_MUTE_ON : AUDIO_MUTE_OFF);
+  }
+  return (void *)(uintptr_t)errors;
+}
+
+static void *VolumeThread(void *Arg)
+{
+  (void)Arg;
+  return (void *)(uintptr_t)cs43l22_SetVolume(&hcs43, 30);
+}
+
+static void *QueueGetThread(void *Arg)
+{
+  uint32_t msg;
+
+  usleep(10000);
+  cs43l22_OS_QueueGet((cs43l22_os_queue_t)Arg, &msg, CS43L22_OS_WAIT_FOREVER);
+  return NULL;
+}
+
+/* Tests ---------------------------------------------------------------------*/
+static void Test_BeforeStart(void)
+{
+  hcs43.hi2c = &hi2c;
+  hcs43.hi2s = &hi2s;
+  hcs43.TxRefillCallback = Refill;
+
+  /* No task yet: the caller runs the command itself */
+  CHECK(cs43l22_IsRemote(&hcs43) == 0);
+  CHECK(cs43l22_Init(&hcs43, OUTPUT_DEVICE_BOTH, 70, AUDIO_FREQUENCY_48K) == HAL_OK);
+
+  CHECK(cs43l22_TaskStart(&hcs43) == HAL_OK);
+  CHECK(hcs43.task != NULL);
+  CHECK(hcs43.refillTask != NULL);
+  CHECK(hcs43.task != hcs43.refillTask);
+
+  /* Started once */
+  {
+    cs43l22_os_thread_t task = hcs43.task;
+    CHECK(cs43l22_TaskStart(&hcs43) == HAL_OK);
+    CHECK(hcs43.task == task);
+  }
+}
+
+static void Test_Dispatch(void)
+{
+  cs43l22_RoutingTypeDef routing = { OUTPUT_DEVICE_BOTH, 9, 0, CS43L22_ROUTE_HW };
+
+  CHECK(cs43l22_IsRemote(&hcs43) == 1);
+
+  /* The result of the command comes back to the caller */
+  sim_reg[CS43L22_CHIPID_ADDR] = 0xE3;
+  CHECK(cs43l22_ReadID(&hcs43) == CS43L22_ID);
+  CHECK(cs43l22_SetRouting(&hcs43, &routing) == HAL_ERROR);
+  CHECK(cs43l22_SetVolume(&hcs43, 50) == HAL_OK);
+
+  /* Executed by the control task */
+  CHECK(sim_remote == 0);
+}
+
+static void Test_Threads(void)
+{
+  pthread_t thread[API_THREADS];
+  void *errors;
+  uint32_t i;
+
+  for (i = 0; i < API_THREADS; i++) pthread_create(&thread[i], NULL, ApiThread, (void *)(uintptr_t)i);
+  for (i = 0; i < API_THREADS; i++)
+  {
+    pthread_join(thread[i], &errors);
+    CHECK(errors == NULL);
+  }
+
+  /* One bus user, one command at a time */
+  CHECK(sim_overlaps == 0);
+  CHECK(sim_remote == 0);
+  CHECK(sim_reg[CS43L22_REG_MASTER_A_VOL] == sim_reg[CS43L22_REG_MASTER_B_VOL]);
+  CHECK(sim_reg[CS43L22_REG_HEADPHONE_A_VOL] == sim_reg[CS43L22_REG_HEADPHONE_B_VOL]);
+  CHECK(ImageMatches());
+}
+
+static void Test_Refill(void)
+{
+  pthread_t thread;
+  void *status;
+  uint32_t count;
+  uint32_t i;
+
+  CHECK(cs43l22_StreamSound(&hcs43, buffer, BUFFER_SIZE) == HAL_OK);
+  CHECK(cs43l22_Play(&hcs43) == HAL_OK);
+
+  /* Each half goes to the refill task */
+  TxEvent(0);
+  CHECK(refills == 1);
+  CHECK(refill_block == buffer);
+  CHECK(refill_size == BUFFER_SIZE / 2);
+  CHECK(refill_inTask == 1);
+  CHECK(refill_remote == 1);
+
+  TxEvent(1);
+  CHECK(refills == 2);
+  CHECK(refill_block == buffer + BUFFER_SIZE / 2);
+  CHECK(refill_size == BUFFER_SIZE / 2);
+
+  /* A refill does not wait for a command stuck on the bus */
+  sim_hold = 1;
+  pthread_create(&thread, NULL, VolumeThread, NULL);
+  WAIT_FOR(sim_holding);
+  CHECK(sim_holding == 1);
+  TxEvent(0);
+  CHECK(refills == 3);
+  CHECK(sim_holding == 1);
+  sim_hold = 0;
+  pthread_join(thread, &status);
+  CHECK(status == (void *)(uintptr_t)HAL_OK);
+
+  /* A refill task that falls behind: the DMA hooks never block, the
+     requests that do not fit in the queue are counted */
+  refill_hold = 1;
+  cs43l22_TxHalfCpltISR(&hcs43);
+  WAIT_FOR(refill_holding);
+  count = refills;
+  for (i = 0; i < CS43L22_TASK_QUEUE_SIZE + 2; i++) cs43l22_TxCpltISR(&hcs43);
+  CHECK(hcs43.missedRefills == 2);
+  refill_hold = 0;
+  WAIT_FOR(refills == count + 1 + CS43L22_TASK_QUEUE_SIZE);
+  CHECK(refills == count + 1 + CS43L22_TASK_QUEUE_SIZE);
+}
+
+static void Test_Routing(void)
+{
+  cs43l22_RoutingTypeDef routing = { OUTPUT_DEVICE_BOTH, CS43L22_CHMAP_SWAP, 0, CS43L22_ROUTE_HW };
+
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x00);
+
+  /* Playing: nothing is written before the block boundaries */
+  CHECK(cs43l22_SetRouting(&hcs43, &routing) == HAL_OK);
+  usleep(5000);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x00);
+
+  /* First boundary: the routing is selected for the block refilled */
+  TxEvent(0);
+  usleep(5000);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x00);
+
+  /* Second boundary: that block plays, the control task writes the mixer */
+  TxEvent(1);
+  WAIT_FOR(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0xF0);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0xF0);
+  CHECK(sim_reg[CS43L22_REG_PLAYBACK_CTL2] == 0x00);
+
+  /* Software mono: the refilled block is downmixed, the codec mixer goes
+     back to stereo one boundary later */
+  routing.channelMap = CS43L22_CHMAP_MONO;
+  routing.engine = CS43L22_ROUTE_SW;
+  routing.speakerMono = 1;
+  CHECK(cs43l22_SetRouting(&hcs43, &routing) == HAL_OK);
+  TxEvent(0);
+  CHECK((int16_t)buffer[0] == 2000);
+  CHECK((int16_t)buffer[1] == 2000);
+  CHECK((int16_t)buffer[BUFFER_SIZE / 2 - 1] == 2000);
+  usleep(5000);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0xF0);
+
+  TxEvent(1);
+  WAIT_FOR(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x00);
+  CHECK(sim_reg[CS43L22_REG_CH_MIXER_SWAP] == 0x00);
+  WAIT_FOR(sim_reg[CS43L22_REG_PLAYBACK_CTL2] == 0x06);
+  CHECK(sim_reg[CS43L22_REG_PLAYBACK_CTL2] == 0x06);
+
+  /* Written by the control task only, one transaction at a time */
+  CHECK(sim_remote == 0);
+  CHECK(sim_overlaps == 0);
+
+  /* cs43l22_Process() is dispatched too, with nothing left to write */
+  CHECK(cs43l22_Process(&hcs43) == HAL_OK);
+  CHECK(ImageMatches());
+}
+
+static void Test_QueueTimeout(void)
+{
+  cs43l22_os_queue_t queue = cs43l22_OS_QueueCreate(2, sizeof(uint32_t));
+  pthread_t thread;
+  uint32_t msg;
+  uint32_t tickstart;
+
+  CHECK(queue != NULL);
+  msg = 1;
+  CHECK(cs43l22_OS_QueuePut(queue, &msg, 0) == CS43L22_OS_OK);
+  msg = 2;
+  CHECK(cs43l22_OS_QueuePut(queue, &msg, 0) == CS43L22_OS_OK);
+
+  /* Full: fails at once, or once the timeout has expired */
+  msg = 3;
+  CHECK(cs43l22_OS_QueuePut(queue, &msg, 0) == CS43L22_OS_TIMEOUT);
+  tickstart = HAL_GetTick();
+  CHECK(cs43l22_OS_QueuePut(queue, &msg, 20) == CS43L22_OS_TIMEOUT);
+  CHECK(HAL_GetTick() - tickstart >= 20);
+
+  /* Room made while waiting */
+  pthread_create(&thread, NULL, QueueGetThread, queue);
+  CHECK(cs43l22_OS_QueuePut(queue, &msg, 1000) == CS43L22_OS_OK);
+  pthread_join(thread, NULL);
+
+  /* FIFO order, then empty */
+  CHECK((cs43l22_OS_QueueGet(queue, &msg, 0) == CS43L22_OS_OK) && (msg == 2));
+  CHECK((cs43l22_OS_QueueGet(queue, &msg, 0) == CS43L22_OS_OK) && (msg == 3));
+  tickstart = HAL_GetTick();
+  CHECK(cs43l22_OS_QueueGet(queue, &msg, 20) == CS43L22_OS_TIMEOUT);
+  CHECK(HAL_GetTick() - tickstart >= 20);
+}
+
+int main(void)
+{
+  Test_BeforeStart();
+  Test_Dispatch();
+  Test_Threads();
+  Test_Refill();
+  Test_Routing();
+  Test_QueueTimeout();
+
+  printf("test_task: %s\n", (failures == 0)? "PASS" : "FAIL");
+  return (failures == 0)? 0 : 1;
+}